@@ -40,6 +40,20 @@ static void __make_cq_entry(int eid, u16 ret)
 	__make_cq_entry_results(eid, ret, 0, 0);
 }
 
+/*
+ * A queue starts from 0 in the shadow doorbell too, whether it is new or
+ * deleted. EventIdx right behind it tells the host that no doorbell write
+ * is needed.
+ */
+static void __reset_dbbuf(int dbs_idx)
+{
+	if (!nvmev_vdev->dbbuf_dbs)
+		return;
+
+	nvmev_vdev->dbbuf_dbs[nvmev_dbbuf_idx(dbs_idx)] = 0;
+	nvmev_vdev->dbbuf_eis[nvmev_dbbuf_idx(dbs_idx)] = -1;
+}
+
 
 /***
  * Queue managements
@@ -88,7 +102,8 @@ static void __nvmev_admin_create_cq(int eid)
 			cq->cq[i] = (void *)((uint64_t)cq->mapped + i * PAGE_SIZE);
 	}
 
-	nvmev_vdev->cqes[cq->qid] = cq;
+	__reset_dbbuf(cq->qid * 2 + 1);
+	smp_store_release(&nvmev_vdev->cqes[cq->qid], cq);
 
 	dbs_idx = cq->qid * 2 + 1;
 	nvmev_vdev->dbs[dbs_idx] = nvmev_vdev->old_dbs[dbs_idx] = 0;
@@ -105,9 +120,12 @@ static void __nvmev_admin_delete_cq(int eid)
 	qid = sq_entry(eid).delete_queue.qid;
 
 	cq = nvmev_vdev->cqes[qid];
-	nvmev_vdev->cqes[qid] = NULL;
+	WRITE_ONCE(nvmev_vdev->cqes[qid], NULL);
 
 	if (cq) {
+		/* Other dispatchers may still be reaping the CQ */
+		nvmev_sync_dispatchers();
+		__reset_dbbuf(qid * 2 + 1);
 		kfree(cq->cq);
 		if (cq->mapped)
 			memunmap(cq->mapped);
@@ -130,7 +148,7 @@ static void __nvmev_admin_create_sq(int eid)
 	sq->qid = cmd->sqid;
 	sq->cqid = cmd->cqid;
 
-	sq->priority = cmd->sq_flags & 0xFFFE;
+	sq->priority = cmd->sq_flags & (3 << 1); /* QPRIO */
 	sq->queue_size = cmd->qsize + 1;
 
 	/* TODO Physically non-contiguous prp list */
@@ -150,7 +168,8 @@ static void __nvmev_admin_create_sq(int eid)
 			sq->sq[i] = (void *)((uint64_t)sq->mapped + i * PAGE_SIZE);
 	}
 
-	nvmev_vdev->sqes[sq->qid] = sq;
+	__reset_dbbuf(sq->qid * 2);
+	smp_store_release(&nvmev_vdev->sqes[sq->qid], sq);
 
 	dbs_idx = sq->qid * 2;
 	nvmev_vdev->dbs[dbs_idx] = 0;
@@ -169,9 +188,12 @@ static void __nvmev_admin_delete_sq(int eid)
 	qid = cmd->qid;
 
 	sq = nvmev_vdev->sqes[qid];
-	nvmev_vdev->sqes[qid] = NULL;
+	WRITE_ONCE(nvmev_vdev->sqes[qid], NULL);
 
 	if (sq) {
+		/* Other dispatchers may still be launching commands from the SQ */
+		nvmev_sync_dispatchers();
+		__reset_dbbuf(qid * 2);
 		kfree(sq->sq);
 		if (sq->mapped)
 			memunmap(sq->mapped);
@@ -218,6 +240,7 @@ static void __nvmev_admin_get_log_page(int eid)
 				[nvme_admin_set_features] = cpu_to_le32(NVME_CMD_EFFECTS_CSUPP),
 				[nvme_admin_get_features] = cpu_to_le32(NVME_CMD_EFFECTS_CSUPP),
 				[nvme_admin_async_event] = cpu_to_le32(NVME_CMD_EFFECTS_CSUPP),
+				[nvme_admin_dbbuf] = cpu_to_le32(NVME_CMD_EFFECTS_CSUPP),
 				// [nvme_admin_keep_alive] = cpu_to_le32(NVME_CMD_EFFECTS_CSUPP),
 			},
 			.iocs = {
@@ -426,6 +449,7 @@ static void __nvmev_admin_identify_ctrl(int eid)
 	memset(ctrl, 0x00, sizeof(*ctrl));
 
 	ctrl->nn = nvmev_vdev->nr_ns;
+	ctrl->oacs = NVME_CTRL_OACS_DBBUF_SUPP;
 	ctrl->oncs = 0; //optional command
 	ctrl->acl = 3; //minimum 4 required, 0's based value
 	ctrl->vwc = 0;
@@ -435,6 +459,7 @@ static void __nvmev_admin_identify_ctrl(int eid)
 	ctrl->mdts = nvmev_vdev->mdts;
 	ctrl->sqes = 0x66;
 	ctrl->cqes = 0x44;
+	ctrl->sgls = NVME_CTRL_SGLS_SUPPORTED | NVME_CTRL_SGLS_BIT_BUCKET;
 
 	__make_cq_entry(eid, NVME_SC_SUCCESS);
 }
@@ -482,6 +507,8 @@ static void __nvmev_admin_set_features(int eid)
 
 	switch (cmd->fid) {
 	case NVME_FEAT_ARBITRATION:
+		WRITE_ONCE(nvmev_vdev->arbitration, cmd->dword11 & 0xFFFFFF07);
+		break;
 	case NVME_FEAT_POWER_MGMT:
 	case NVME_FEAT_LBA_RANGE:
 	case NVME_FEAT_TEMP_THRESH:
@@ -503,7 +530,23 @@ static void __nvmev_admin_set_features(int eid)
 		break;
 	}
 	case NVME_FEAT_IRQ_COALESCE:
-	case NVME_FEAT_IRQ_CONFIG:
+		nvmev_vdev->irq_aggr_thr = cmd->dword11 & 0xFF;
+		nvmev_vdev->irq_aggr_time = (cmd->dword11 >> 8) & 0xFF;
+		break;
+	case NVME_FEAT_IRQ_CONFIG: {
+		unsigned int vector = cmd->dword11 & 0xFFFF;
+
+		if (vector > NR_MAX_IO_QUEUE) {
+			__make_cq_entry(eid, NVME_SC_INVALID_FIELD | NVME_SC_DNR);
+			return;
+		}
+
+		if (cmd->dword11 & (1 << 16))
+			set_bit(vector, nvmev_vdev->irq_coalesce_disabled);
+		else
+			clear_bit(vector, nvmev_vdev->irq_coalesce_disabled);
+		break;
+	}
 	case NVME_FEAT_WRITE_ATOMIC:
 	case NVME_FEAT_ASYNC_EVENT:
 	case NVME_FEAT_AUTO_PST:
@@ -527,6 +570,8 @@ static void __nvmev_admin_get_features(int eid)
 
 	switch (cmd->fid) {
 	case NVME_FEAT_ARBITRATION:
+		result0 = nvmev_vdev->arbitration;
+		break;
 	case NVME_FEAT_POWER_MGMT:
 	case NVME_FEAT_LBA_RANGE:
 	case NVME_FEAT_TEMP_THRESH:
@@ -537,7 +582,21 @@ static void __nvmev_admin_get_features(int eid)
 		result0 = ((nvmev_vdev->nr_cq - 1) << 16 | (nvmev_vdev->nr_sq - 1));
 		break;
 	case NVME_FEAT_IRQ_COALESCE:
-	case NVME_FEAT_IRQ_CONFIG:
+		result0 = nvmev_vdev->irq_aggr_time << 8 | nvmev_vdev->irq_aggr_thr;
+		break;
+	case NVME_FEAT_IRQ_CONFIG: {
+		unsigned int vector = cmd->dword11 & 0xFFFF;
+
+		if (vector > NR_MAX_IO_QUEUE) {
+			__make_cq_entry(eid, NVME_SC_INVALID_FIELD | NVME_SC_DNR);
+			return;
+		}
+
+		result0 = vector;
+		if (test_bit(vector, nvmev_vdev->irq_coalesce_disabled))
+			result0 |= 1 << 16;
+		break;
+	}
 	case NVME_FEAT_WRITE_ATOMIC:
 	case NVME_FEAT_ASYNC_EVENT:
 	case NVME_FEAT_AUTO_PST:
@@ -562,6 +621,54 @@ static void __nvmev_admin_async_event(int eid)
 	// __make_cq_entry(eid, NVME_SC_ASYNC_LIMIT);
 }
 
+/*
+ * PRP1 points to the shadow doorbells and PRP2 to the EventIdx buffer, both
+ * a page laid out like the doorbell registers. The dispatchers then read the
+ * I/O queue doorbells from the former and keep the latter up to date.
+ */
+static void __nvmev_admin_dbbuf(int eid)
+{
+	struct nvmev_admin_queue *queue = nvmev_vdev->admin_q;
+	struct nvme_common_command *cmd = &sq_entry(eid).common;
+	u64 dbs_addr = cmd->prp1;
+	u64 eis_addr = cmd->prp2;
+	u32 *dbs, *eis;
+	int qid;
+
+	/* Both buffers are a page, which must hold the doorbells of all queues */
+	if (!dbs_addr || !eis_addr || (dbs_addr | eis_addr) & ~PAGE_MASK ||
+	    !pfn_valid(dbs_addr >> PAGE_SHIFT) || !pfn_valid(eis_addr >> PAGE_SHIFT) ||
+	    nvmev_dbbuf_idx(NR_MAX_IO_QUEUE * 2 + 1) >= PAGE_SIZE / sizeof(u32)) {
+		__make_cq_entry(eid, NVME_SC_INVALID_FIELD | NVME_SC_DNR);
+		return;
+	}
+
+	dbs = prp_address(dbs_addr);
+	eis = prp_address(eis_addr);
+
+	/* Pick up from where the doorbell registers are */
+	for (qid = 1; qid <= NR_MAX_IO_QUEUE; qid++) {
+		unsigned int sq_idx = nvmev_dbbuf_idx(qid * 2);
+		unsigned int cq_idx = nvmev_dbbuf_idx(qid * 2 + 1);
+
+		if (nvmev_vdev->sqes[qid]) {
+			dbs[sq_idx] = nvmev_vdev->old_dbs[qid * 2];
+			eis[sq_idx] = nvmev_vdev->old_dbs[qid * 2] - 1;
+		}
+		if (nvmev_vdev->cqes[qid]) {
+			dbs[cq_idx] = nvmev_vdev->old_dbs[qid * 2 + 1];
+			eis[cq_idx] = nvmev_vdev->old_dbs[qid * 2 + 1] - 1;
+		}
+	}
+
+	WRITE_ONCE(nvmev_vdev->dbbuf_eis, eis);
+	smp_store_release(&nvmev_vdev->dbbuf_dbs, dbs);
+
+	NVMEV_INFO("Doorbell buffer at %#llx, EventIdx at %#llx\n", dbs_addr, eis_addr);
+
+	__make_cq_entry(eid, NVME_SC_SUCCESS);
+}
+
 
 static void __nvmev_proc_admin_req(int entry_id)
 {
@@ -601,6 +708,9 @@ static void __nvmev_proc_admin_req(int entry_id)
 	case nvme_admin_async_event:
 		__nvmev_admin_async_event(entry_id);
 		break;
+	case nvme_admin_dbbuf:
+		__nvmev_admin_dbbuf(entry_id);
+		break;
 	case nvme_admin_activate_fw:
 	case nvme_admin_download_fw:
 	case nvme_admin_format_nvm:
@@ -0,0 +1,46 @@
+// SPDX-License-Identifier: GPL-2.0-only
+
+#include <linux/clocksource.h>
+#ifdef CONFIG_X86
+#include <asm/cpufeature.h>
+#include <asm/tsc.h>
+#endif
+
+#include "nvmev.h"
+#include "clock.h"
+
+struct nvmev_clock nvmev_clock_src __read_mostly;
+
+void nvmev_clock_init(void)
+{
+	struct nvmev_clock *clk = &nvmev_clock_src;
+
+	clk->use_tsc = false;
+
+#ifdef CONFIG_X86
+	/*
+	 * The TSC must tick at a constant rate, keep ticking in deep C-states
+	 * and be in sync across CPUs. The kernel has checked the latter for us.
+	 */
+	if (boot_cpu_has(X86_FEATURE_CONSTANT_TSC) && boot_cpu_has(X86_FEATURE_NONSTOP_TSC) &&
+	    !check_tsc_unstable() && tsc_khz) {
+		unsigned long flags;
+
+		/* TSC kHz to ns per msec. Products are 128-bit, so go for precision */
+		clocks_calc_mult_shift(&clk->mult, &clk->shift, tsc_khz, NSEC_PER_MSEC, 1);
+
+		/* Anchor to the monotonic clock so that both read alike at load */
+		local_irq_save(flags);
+		clk->base_nsecs = ktime_get_ns();
+		clk->base_cycles = rdtsc_ordered();
+		local_irq_restore(flags);
+
+		clk->use_tsc = true;
+		NVMEV_INFO("Clock: TSC at %u kHz (mult %u, shift %u)\n", tsc_khz, clk->mult,
+			   clk->shift);
+		return;
+	}
+#endif
+
+	NVMEV_INFO("Clock: ktime_get_ns()\n");
+}
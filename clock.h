@@ -0,0 +1,61 @@
+// SPDX-License-Identifier: GPL-2.0-only
+
+#ifndef _LIB_NVMEV_CLOCK_H
+#define _LIB_NVMEV_CLOCK_H
+
+#include <linux/types.h>
+#include <linux/atomic.h>
+#include <linux/ktime.h>
+#include <linux/math64.h>
+#ifdef CONFIG_X86
+#include <asm/msr.h>
+#endif
+
+/*
+ * The time base shared by the dispatchers, the IO workers and the device
+ * models. It must be monotonic across CPUs, since a target time computed on
+ * a dispatcher is compared against the clock of a worker.
+ *
+ * With an invariant TSC that the kernel trusts, the time is converted from
+ * the local TSC with a mult/shift pair set up once at load. Otherwise it
+ * falls back to ktime_get_ns().
+ */
+struct nvmev_clock {
+	u64 base_cycles;
+	u64 base_nsecs;
+	u32 mult;
+	u32 shift;
+	bool use_tsc;
+};
+
+extern struct nvmev_clock nvmev_clock_src;
+
+static inline unsigned long long nvmev_clock(void)
+{
+#ifdef CONFIG_X86
+	if (likely(nvmev_clock_src.use_tsc)) {
+		u64 cycles = rdtsc_ordered() - nvmev_clock_src.base_cycles;
+
+		return nvmev_clock_src.base_nsecs +
+		       mul_u64_u32_shr(cycles, nvmev_clock_src.mult, nvmev_clock_src.shift);
+	}
+#endif
+	return ktime_get_ns();
+}
+
+/*
+ * Raise @nsecs to the current time unless it is later already. Parts of a
+ * copy finishing on different CPUs leave the time the last one finished.
+ */
+static inline void nvmev_clock_max(atomic64_t *nsecs)
+{
+	s64 now = nvmev_clock();
+	s64 old = atomic64_read(nsecs);
+
+	while (old < now && !atomic64_try_cmpxchg(nsecs, &old, now))
+		;
+}
+
+void nvmev_clock_init(void);
+
+#endif /* _LIB_NVMEV_CLOCK_H */
@@ -12,10 +12,19 @@
 #define COST_BENEFIT (1)
 #define RANDOM (2)
 
-static inline bool last_pg_in_wordline(struct conv_ftl *conv_ftl, struct ppa *ppa)
+/* Order greedy victims (GREEDY and SLC migration) with vpc buckets instead of a pqueue */
+#define VPC_BUCKETS (1)
+
+static inline uint32_t pgs_per_oneshotpg(struct conv_ftl *conv_ftl, struct ppa *ppa)
 {
 	struct ssdparams *spp = &conv_ftl->ssd->sp;
-	return (ppa->g.pg % spp->pgs_per_oneshotpg) == (spp->pgs_per_oneshotpg - 1);
+	return is_slc_blk(conv_ftl->ssd, ppa) ? spp->pgs_per_oneshotpg_slc : spp->pgs_per_oneshotpg;
+}
+
+static inline bool last_pg_in_wordline(struct conv_ftl *conv_ftl, struct ppa *ppa)
+{
+	uint32_t pgs = pgs_per_oneshotpg(conv_ftl, ppa);
+	return (ppa->g.pg % pgs) == (pgs - 1);
 }
 
 static bool should_gc(struct conv_ftl *conv_ftl)
@@ -48,7 +57,14 @@ static uint64_t ppa2pgidx(struct conv_ftl *conv_ftl, struct ppa *ppa)
 			ppa->g.ch, ppa->g.lun, ppa->g.pl, ppa->g.blk, ppa->g.pg);
 
 	pgidx = ppa->g.ch * spp->pgs_per_ch + ppa->g.lun * spp->pgs_per_lun +
-		ppa->g.pl * spp->pgs_per_pl + ppa->g.blk * spp->pgs_per_blk + ppa->g.pg;
+		ppa->g.pl * spp->pgs_per_pl + ppa->g.pg;
+
+	/* SLC blocks come first in a plane and hold fewer pages */
+	if (is_slc_blk(conv_ftl->ssd, ppa))
+		pgidx += ppa->g.blk * spp->pgs_per_blk_slc;
+	else
+		pgidx += spp->blks_per_pl_slc * spp->pgs_per_blk_slc +
+			 (ppa->g.blk - spp->blks_per_pl_slc) * spp->pgs_per_blk;
 
 	NVMEV_ASSERT(pgidx < spp->tt_pgs);
 
@@ -95,6 +111,210 @@ static inline void victim_line_set_pos(void *a, size_t pos)
 	((struct line *)a)->pos = pos;
 }
 
+/*
+ * Cost-benefit victim index. Victim lines are fully written, so ipc = pgs_per_line - vpc
+ * and the score vpc / (ipc * age_lvl) grows with vpc within an age level. Each level thus
+ * keeps a vpc heap, and the victim is the best of the heap tops. The lines of a level are
+ * also listed from the least recently invalidated, so that aged ones move up from the head.
+ */
+static const uint64_t cb_age_limit[CB_AGE_LVLS - 1] = {
+	// fio 실행시간 고려
+	10 * NSEC_PER_SEC,  20 * NSEC_PER_SEC,	45 * NSEC_PER_SEC,
+	90 * NSEC_PER_SEC, 180 * NSEC_PER_SEC, 360 * NSEC_PER_SEC,
+};
+
+static inline bool uses_cb_index(struct conv_ftl *conv_ftl, struct line_mgmt *lm)
+{
+	return GC_MODE == COST_BENEFIT && lm == &conv_ftl->lm;
+}
+
+static int cb_age_lvl(uint64_t age)
+{
+	int lvl = 0;
+
+	while (lvl < CB_AGE_LVLS - 1 && age > cb_age_limit[lvl])
+		lvl++;
+
+	return lvl;
+}
+
+/* Lines mostly come in as the most recently invalidated, so the walk is short */
+static void __cb_add(struct line_mgmt *lm, struct line *line, int lvl)
+{
+	struct list_head *head = &lm->cb_age_list[lvl];
+	struct list_head *pos = head;
+
+	while (pos->prev != head && list_entry(pos->prev, struct line, entry)->age > line->age)
+		pos = pos->prev;
+
+	list_add_tail(&line->entry, pos);
+	line->cb_lvl = lvl;
+	pqueue_insert(lm->cb_pq[lvl], line);
+}
+
+static void __cb_del(struct line_mgmt *lm, struct line *line)
+{
+	pqueue_remove(lm->cb_pq[line->cb_lvl], line);
+	list_del_init(&line->entry);
+}
+
+static void cb_insert(struct line_mgmt *lm, struct line *line)
+{
+	__cb_add(lm, line, cb_age_lvl(nvmev_clock() - line->age));
+}
+
+/* A page of a queued line was invalidated just now. This also takes vpc down by one */
+static void cb_invalidate(struct line_mgmt *lm, struct line *line)
+{
+	if (line->cb_lvl == 0) {
+		pqueue_change_priority(lm->cb_pq[0], line->vpc - 1, line);
+		list_move_tail(&line->entry, &lm->cb_age_list[0]);
+		return;
+	}
+
+	__cb_del(lm, line);
+	line->vpc--;
+	__cb_add(lm, line, 0);
+}
+
+static struct line *cb_select(struct line_mgmt *lm)
+{
+	uint64_t now = nvmev_clock();
+	struct line *victim = NULL;
+	int lvl;
+
+	for (lvl = 0; lvl < CB_AGE_LVLS - 1; lvl++) {
+		struct line *line, *tmp;
+
+		list_for_each_entry_safe(line, tmp, &lm->cb_age_list[lvl], entry) {
+			if (now - line->age <= cb_age_limit[lvl])
+				break;
+			__cb_del(lm, line);
+			__cb_add(lm, line, lvl + 1);
+		}
+	}
+
+	for (lvl = 0; lvl < CB_AGE_LVLS; lvl++) {
+		struct line *line = pqueue_peek(lm->cb_pq[lvl]);
+
+		/* line->vpc / (line->ipc * (lvl + 1)) < victim's, without dividing */
+		if (line && (!victim || (uint64_t)line->vpc * victim->ipc * (victim->cb_lvl + 1) <
+						(uint64_t)victim->vpc * line->ipc * (lvl + 1)))
+			victim = line;
+	}
+
+	return victim;
+}
+
+/*
+ * Greedy victim buckets. A line is listed under its vpc, so an invalidation is a list
+ * move and the victim is the first line of the lowest non-empty bucket. min_vpc only
+ * goes down on updates and up on picks, which keeps the scan amortized O(1).
+ * line->pos is non-zero while the line is listed, as with the pqueue.
+ */
+static inline bool uses_vpc_buckets(struct conv_ftl *conv_ftl, struct line_mgmt *lm)
+{
+	return VPC_BUCKETS && (lm == &conv_ftl->slm || GC_MODE == GREEDY);
+}
+
+static void vb_insert(struct line_mgmt *lm, struct line *line)
+{
+	list_add_tail(&line->entry, &lm->vpc_buckets[line->vpc]);
+	line->pos = 1;
+	lm->min_vpc = min_t(uint32_t, lm->min_vpc, line->vpc);
+}
+
+static void vb_invalidate(struct line_mgmt *lm, struct line *line)
+{
+	line->vpc--;
+	list_move_tail(&line->entry, &lm->vpc_buckets[line->vpc]);
+	lm->min_vpc = min_t(uint32_t, lm->min_vpc, line->vpc);
+}
+
+static struct line *vb_peek(struct line_mgmt *lm)
+{
+	while (lm->min_vpc < lm->nr_vpc_buckets && list_empty(&lm->vpc_buckets[lm->min_vpc]))
+		lm->min_vpc++;
+
+	if (lm->min_vpc == lm->nr_vpc_buckets)
+		return NULL;
+
+	return list_first_entry(&lm->vpc_buckets[lm->min_vpc], struct line, entry);
+}
+
+static void vb_remove(struct line_mgmt *lm, struct line *line)
+{
+	list_del_init(&line->entry);
+}
+
+static void init_victim_index(struct conv_ftl *conv_ftl, struct line_mgmt *lm,
+			      uint32_t pgs_per_line)
+{
+	uint32_t i;
+
+	lm->victim_line_pq = NULL;
+	lm->vpc_buckets = NULL;
+
+	if (uses_cb_index(conv_ftl, lm)) {
+		for (i = 0; i < CB_AGE_LVLS; i++) {
+			lm->cb_pq[i] = pqueue_init(lm->tt_lines, victim_line_cmp_pri,
+						   victim_line_get_pri, victim_line_set_pri,
+						   victim_line_get_pos, victim_line_set_pos);
+			INIT_LIST_HEAD(&lm->cb_age_list[i]);
+		}
+	} else if (uses_vpc_buckets(conv_ftl, lm)) {
+		lm->nr_vpc_buckets = pgs_per_line + 1;
+		lm->vpc_buckets = vmalloc_node(sizeof(struct list_head) * lm->nr_vpc_buckets,
+					       conv_ftl->numa_node);
+		for (i = 0; i < lm->nr_vpc_buckets; i++)
+			INIT_LIST_HEAD(&lm->vpc_buckets[i]);
+		lm->min_vpc = lm->nr_vpc_buckets;
+	} else {
+		lm->victim_line_pq = pqueue_init(lm->tt_lines, victim_line_cmp_pri,
+						 victim_line_get_pri, victim_line_set_pri,
+						 victim_line_get_pos, victim_line_set_pos);
+	}
+}
+
+static void remove_victim_index(struct conv_ftl *conv_ftl, struct line_mgmt *lm)
+{
+	int i;
+
+	if (uses_cb_index(conv_ftl, lm)) {
+		for (i = 0; i < CB_AGE_LVLS; i++)
+			pqueue_free(lm->cb_pq[i]);
+	} else if (uses_vpc_buckets(conv_ftl, lm)) {
+		vfree(lm->vpc_buckets);
+	} else {
+		pqueue_free(lm->victim_line_pq);
+	}
+}
+
+static void insert_victim_line(struct conv_ftl *conv_ftl, struct line_mgmt *lm, struct line *line)
+{
+	if (uses_cb_index(conv_ftl, lm))
+		cb_insert(lm, line);
+	else if (uses_vpc_buckets(conv_ftl, lm))
+		vb_insert(lm, line);
+	else
+		pqueue_insert(lm->victim_line_pq, line);
+}
+
+/* Lowest vpc first. Only for the greedy orders, not for cost-benefit */
+static struct line *peek_greedy_victim(struct conv_ftl *conv_ftl, struct line_mgmt *lm)
+{
+	return uses_vpc_buckets(conv_ftl, lm) ? vb_peek(lm) : pqueue_peek(lm->victim_line_pq);
+}
+
+static void remove_greedy_victim(struct conv_ftl *conv_ftl, struct line_mgmt *lm,
+				 struct line *line)
+{
+	if (uses_vpc_buckets(conv_ftl, lm))
+		vb_remove(lm, line);
+	else
+		pqueue_pop(lm->victim_line_pq);
+}
+
 static inline void consume_write_credit(struct conv_ftl *conv_ftl)
 {
 	conv_ftl->wfc.write_credits--;
@@ -128,7 +348,10 @@ static void init_lines(struct conv_ftl *conv_ftl)
 		lm->tt_lines = spp->blks_per_pl_tlc;
 		NVMEV_ASSERT(lm->tt_lines == spp->tt_lines_tlc);
 	}
-	lm->lines = vmalloc(sizeof(struct line) * lm->tt_lines);
+	lm->lines = vmalloc_node(sizeof(struct line) * lm->tt_lines, conv_ftl->numa_node);
+	lm->pgs_per_blk = spp->pgs_per_blk;
+	lm->pgs_per_oneshotpg = spp->pgs_per_oneshotpg;
+	lm->pgs_per_line = spp->pgs_per_line;
 
 	INIT_LIST_HEAD(&lm->free_line_list);
 	INIT_LIST_HEAD(&lm->full_line_list);
@@ -140,16 +363,15 @@ static void init_lines(struct conv_ftl *conv_ftl)
 	} 
 	*/
 
-	lm->victim_line_pq = pqueue_init(lm->tt_lines, victim_line_cmp_pri, victim_line_get_pri,
-					 victim_line_set_pri, victim_line_get_pos,
-					 victim_line_set_pos);
+	init_victim_index(conv_ftl, lm, spp->pgs_per_line);
 
 	lm->free_line_cnt = 0;
 	for (i = 0; i < lm->tt_lines; i++) {
 		lm->lines[i] = (struct line){
-			.id = i,
+			.id = spp->blks_per_pl_slc + i, /* TLC blocks follow the SLC ones */
 			.ipc = 0,
 			.vpc = 0,
+			.age = 0,
 			.pos = 0,
 			.entry = LIST_HEAD_INIT(lm->lines[i].entry),
 		};
@@ -170,14 +392,15 @@ static void init_lines(struct conv_ftl *conv_ftl)
 	if (SLC_CACHE_MODE == ENABLE_SLC_CACHE){
 		slm->tt_lines = spp->blks_per_pl_slc;
 		NVMEV_ASSERT(slm->tt_lines == spp->tt_lines_slc);
-		slm->lines = vmalloc(sizeof(struct line) * slm->tt_lines);
+		slm->lines = vmalloc_node(sizeof(struct line) * slm->tt_lines, conv_ftl->numa_node);
+		slm->pgs_per_blk = spp->pgs_per_blk_slc;
+		slm->pgs_per_oneshotpg = spp->pgs_per_oneshotpg_slc;
+		slm->pgs_per_line = spp->pgs_per_line_slc;
 
 		INIT_LIST_HEAD(&slm->free_line_list);
 		INIT_LIST_HEAD(&slm->full_line_list);
 
-		slm->victim_line_pq = pqueue_init(spp->tt_lines_slc, victim_line_cmp_pri, victim_line_get_pri,
-				victim_line_set_pri, victim_line_get_pos,
-				victim_line_set_pos);
+		init_victim_index(conv_ftl, slm, spp->pgs_per_line_slc);
 	
 		slm->free_line_cnt = 0;
 		for (i = 0; i < slm->tt_lines; i++) {
@@ -201,8 +424,13 @@ static void init_lines(struct conv_ftl *conv_ftl)
 
 static void remove_lines(struct conv_ftl *conv_ftl)
 {
-	pqueue_free(conv_ftl->lm.victim_line_pq);
+	remove_victim_index(conv_ftl, &conv_ftl->lm);
 	vfree(conv_ftl->lm.lines);
+
+	if (SLC_CACHE_MODE == ENABLE_SLC_CACHE) {
+		remove_victim_index(conv_ftl, &conv_ftl->slm);
+		vfree(conv_ftl->slm.lines);
+	}
 }
 
 static void init_write_flow_control(struct conv_ftl *conv_ftl)
@@ -241,7 +469,8 @@ static struct line *get_next_free_line_slc(struct conv_ftl *conv_ftl)
 	struct line *curline = list_first_entry_or_null(&slm->free_line_list, struct line, entry);
 
 	if (!curline) {
-		NVMEV_ERROR("No free line left in SLC region !!!!\n");
+		/* Not an error. Host writes go to TLC until a line is migrated */
+		NVMEV_DEBUG("No free line left in SLC region\n");
 		return NULL;
 	}
 
@@ -257,20 +486,9 @@ static struct write_pointer *__get_wp(struct conv_ftl *ftl, uint32_t io_type)
 		return &ftl->wp;
 	} else if (io_type == GC_IO) {
 		return &ftl->gc_wp;
-	}
-	
-	NVMEV_ASSERT(0);
-	return NULL;
-}
-
-static struct write_pointer *__get_wp_slc(struct conv_ftl *ftl, uint32_t io_type)
-{
-	if (io_type == USER_IO) {
-		return &ftl->swp;
-	} else if (io_type == GC_IO) {
-		return &ftl->gc_wp;
 	} else if (io_type == MIGRATION_IO) {
-		return &ftl->wp;
+		/* Folded SLC data is kept apart from host and GC writes, as GC data is */
+		return &ftl->mig_wp;
 	}
 	
 	NVMEV_ASSERT(0);
@@ -296,29 +514,44 @@ static void prepare_write_pointer(struct conv_ftl *conv_ftl, uint32_t io_type)
 	};
 }
 
-static void advance_write_pointer(struct conv_ftl *conv_ftl, uint32_t io_type)
+/* Host writes go to swp while the SLC region has a free line, otherwise swp.curline is NULL */
+static void prepare_write_pointer_slc(struct conv_ftl *conv_ftl)
+{
+	struct line *curline = get_next_free_line_slc(conv_ftl);
+
+	conv_ftl->swp = (struct write_pointer){
+		.curline = curline,
+		.ch = 0,
+		.lun = 0,
+		.pg = 0,
+		.blk = curline ? curline->id : 0,
+		.pl = 0,
+	};
+}
+
+/* Advance @wpp over the lines of @lm, whose geometry tells the SLC and the TLC region apart */
+static void advance_write_pointer(struct conv_ftl *conv_ftl, struct write_pointer *wpp,
+				  struct line_mgmt *lm)
 {
 	/* 1. 기본 설정 및 포인터 획득 */
 	struct ssdparams *spp = &conv_ftl->ssd->sp;  // SSD 하드웨어 설정값
-	struct line_mgmt *lm = &conv_ftl->lm;  // Line Mgmt
-	// 요청 타입(사용자 IO인지 GC IO인지)에 맞는 쓰기 포인터(wpp)를 가져옴
-	struct write_pointer *wpp = __get_wp(conv_ftl, io_type);
+	bool slc = lm == &conv_ftl->slm;
 
 	NVMEV_DEBUG_VERBOSE("current wpp: ch:%d, lun:%d, pl:%d, blk:%d, pg:%d\n",
 			wpp->ch, wpp->lun, wpp->pl, wpp->blk, wpp->pg);
 
 	/* 2. 페이지 번호 증가 */
-	check_addr(wpp->pg, spp->pgs_per_blk);  // 현재 페이지 번호가 블록 범위를 넘지 않는지 검사
+	check_addr(wpp->pg, lm->pgs_per_blk);  // 현재 페이지 번호가 블록 범위를 넘지 않는지 검사
 	wpp->pg++;  // 페이지 번호 1 증가 (4KB)
 
 	/* 3. 워드라인 완료 체크 */
 	// pgs_per_oneshotpg: 한 번에 물리적으로 기록되는 페이지 묶음
-	if ((wpp->pg % spp->pgs_per_oneshotpg) != 0)  // 4KB 페이지를 하나 썼는데 아직 WL이 안 끝났다면 그냥 나감(out)
+	if ((wpp->pg % lm->pgs_per_oneshotpg) != 0)  // 4KB 페이지를 하나 썼는데 아직 WL이 안 끝났다면 그냥 나감(out)
 		goto out;
 
 	/* 4. 채널 이동 (스트라이핑) */
 	// WL을 다 채웠다면 병렬성을 위해 다음 채널로 이동
-	wpp->pg -= spp->pgs_per_oneshotpg;  // 페이지 번호를 해당 워드라인의 시작점으로 되돌림
+	wpp->pg -= lm->pgs_per_oneshotpg;  // 페이지 번호를 해당 워드라인의 시작점으로 되돌림
 	check_addr(wpp->ch, spp->nchs);  // 채널 범위에 있는지 확인
 	wpp->ch++;  // 다음 채널로 이동
 	if (wpp->ch != spp->nchs)  // 아직 모든 채널을 다 돌지 않았다면 다음 채널에서 쓰기 위해 나감
@@ -336,8 +569,8 @@ static void advance_write_pointer(struct conv_ftl *conv_ftl, uint32_t io_type)
 	wpp->lun = 0;  // 모든 LUN까지 다 돌았으므로 다시 0번 LUN으로 리셋
 	/* 이제 현재 블록 내에서 다음 수직 위치로 페이지 번호를 점프시킴 */
 	/* go to next wordline in the block */
-	wpp->pg += spp->pgs_per_oneshotpg;
-	if (wpp->pg != spp->pgs_per_blk) // 블록의 끝에 도달하지 않았다면 다음 워드라인 시작
+	wpp->pg += lm->pgs_per_oneshotpg;
+	if (wpp->pg != lm->pgs_per_blk) // 블록의 끝에 도달하지 않았다면 다음 워드라인 시작
 		goto out;
 
 	/* 7. 라인(Line/Superblock) 소모 및 관리 */
@@ -346,7 +579,7 @@ static void advance_write_pointer(struct conv_ftl *conv_ftl, uint32_t io_type)
 
 	//현재 라인의 유효 페이지 수(vpc)를 확인하여 상태 분류
 	/* move current line to {victim,full} line list */
-	if (wpp->curline->vpc == spp->pgs_per_line) {
+	if (wpp->curline->vpc == lm->pgs_per_line) {
 		/* all pgs are still valid, move to full line list */
 		/* 모든 페이지가 유효하다면, 이 라인은 아주 깨끗하게 꽉 찬 상태 (FULL) */
 		NVMEV_ASSERT(wpp->curline->ipc == 0);  // 무효 페이지(ipc)가 0이어야 함
@@ -356,182 +589,28 @@ static void advance_write_pointer(struct conv_ftl *conv_ftl, uint32_t io_type)
 	} else {
 		/* 일부 페이지가 쓰자마자 무효화됨(Overwrite 등): 이 라인은 Victim 후보 */
 		NVMEV_DEBUG_VERBOSE("wpp: line is moved to victim list\n");
-		NVMEV_ASSERT(wpp->curline->vpc >= 0 && wpp->curline->vpc < spp->pgs_per_line);  
+		NVMEV_ASSERT(wpp->curline->vpc >= 0 && wpp->curline->vpc < lm->pgs_per_line);  
 		/* there must be some invalid pages in this line */
 		NVMEV_ASSERT(wpp->curline->ipc > 0);  // 무효 페이지가 최소 하나는 있어야 함
 		// pqueue에 삽입 (victim 후보)
-		pqueue_insert(lm->victim_line_pq, wpp->curline);
+		insert_victim_line(conv_ftl, lm, wpp->curline);
 		lm->victim_line_cnt++;
 	}
 
 	/* 8. 새 라인 할당 */
 	/* current line is used up, pick another empty line */
-	check_addr(wpp->blk, spp->blks_per_pl);
+	check_addr(wpp->blk - lm->lines[0].id, lm->tt_lines);
 
 	// 비어있는 새로운 라인을 할당받음 (Free Line -> Active Line)
-	wpp->curline = get_next_free_line(conv_ftl);
+	wpp->curline = slc ? get_next_free_line_slc(conv_ftl) : get_next_free_line(conv_ftl);
+	if (!wpp->curline) {
+		/* The cache is full. migrate_slc_line() rearms swp once it frees a line */
+		NVMEV_ASSERT(slc);
+		return;
+	}
 	NVMEV_DEBUG_VERBOSE("wpp: got new clean line %d\n", wpp->curline->id);
 	wpp->blk = wpp->curline->id;  // 새 블록 번호 업데이트
-	check_addr(wpp->blk, spp->blks_per_pl);
-
-	/* 9. 무결성 검사 */
-	/* make sure we are starting from page 0 in the super block */
-	NVMEV_ASSERT(wpp->pg == 0);
-	NVMEV_ASSERT(wpp->lun == 0);
-	NVMEV_ASSERT(wpp->ch == 0);
-	/* TODO: assume # of pl_per_lun is 1, fix later */
-	NVMEV_ASSERT(wpp->pl == 0);
-
-out:
-	/* 10. 결과 로그 출력 */
-	NVMEV_DEBUG_VERBOSE("advanced wpp: ch:%d, lun:%d, pl:%d, blk:%d, pg:%d (curline %d)\n",
-			wpp->ch, wpp->lun, wpp->pl, wpp->blk, wpp->pg, wpp->curline->id);
-}
-
-static void advance_write_pointer_slc(struct conv_ftl *conv_ftl, uint32_t io_type)
-{
-	/* 1. 기본 설정 및 포인터 획득 */
-	struct ssdparams *spp = &conv_ftl->ssd->sp;  // SSD 하드웨어 설정값
-	struct line_mgmt *lm = &conv_ftl->lm;
-	struct line_mgmt *slm = &conv_ftl->slm;  // Line Mgmt
-	// 요청 타입(사용자 IO인지 GC IO인지)에 맞는 쓰기 포인터(wpp)를 가져옴
-	struct write_pointer *wpp = __get_wp_slc(conv_ftl, io_type);
-
-	NVMEV_DEBUG_VERBOSE("current wpp: ch:%d, lun:%d, pl:%d, blk:%d, pg:%d\n",
-			wpp->ch, wpp->lun, wpp->pl, wpp->blk, wpp->pg);
-	if (io_type != USER_IO){
-		/* 2. 페이지 번호 증가 */
-		check_addr(wpp->pg, spp->pgs_per_blk);  // 현재 페이지 번호가 블록 범위를 넘지 않는지 검사
-		wpp->pg++;  // 페이지 번호 1 증가 (4KB)
-
-		/* 3. 워드라인 완료 체크 */
-		// pgs_per_oneshotpg: 한 번에 물리적으로 기록되는 페이지 묶음
-		if ((wpp->pg % spp->pgs_per_oneshotpg) != 0)  // 4KB 페이지를 하나 썼는데 아직 WL이 안 끝났다면 그냥 나감(out)
-			goto out;
-		/* 4. 채널 이동 (스트라이핑) */
-		// WL을 다 채웠다면 병렬성을 위해 다음 채널로 이동
-		wpp->pg -= spp->pgs_per_oneshotpg;  // 페이지 번호를 해당 워드라인의 시작점으로 되돌림
-		check_addr(wpp->ch, spp->nchs);  // 채널 범위에 있는지 확인
-		wpp->ch++;  // 다음 채널로 이동
-		if (wpp->ch != spp->nchs)  // 아직 모든 채널을 다 돌지 않았다면 다음 채널에서 쓰기 위해 나감
-			goto out;
-
-			/* 5. LUN 이동 */
-		wpp->ch = 0;  // 모든 채널을 다 돌았으므로 다시 0번 채널로 리셋
-		check_addr(wpp->lun, spp->luns_per_ch);
-		wpp->lun++;  // 해당 채널의 다음 LUN으로 이동
-		/* in this case, we should go to next lun */
-		if (wpp->lun != spp->luns_per_ch)  // 아직 모든 LUN을 다 돌지 않았다면 나감
-			goto out;
-
-		/* 6. 다음 워드라인으로 진입 */
-		wpp->lun = 0;  // 모든 LUN까지 다 돌았으므로 다시 0번 LUN으로 리셋
-		/* 이제 현재 블록 내에서 다음 수직 위치로 페이지 번호를 점프시킴 */
-		/* go to next wordline in the block */
-		wpp->pg += spp->pgs_per_oneshotpg;
-		if (wpp->pg != spp->pgs_per_blk) // 블록의 끝에 도달하지 않았다면 다음 워드라인 시작
-			goto out;
-
-		/* 7. 라인(Line/Superblock) 소모 및 관리 */
-		// 여기까지 왔다면 현재 사용 중인 라인(모든 채널/LUN의 해당 블록들)을 모두 쓴 것
-		wpp->pg = 0;  // 페이지 번호 초기화
-
-		//현재 라인의 유효 페이지 수(vpc)를 확인하여 상태 분류
-		/* move current line to {victim,full} line list */
-		if (wpp->curline->vpc == spp->pgs_per_line) {
-			/* all pgs are still valid, move to full line list */
-			/* 모든 페이지가 유효하다면, 이 라인은 아주 깨끗하게 꽉 찬 상태 (FULL) */
-			NVMEV_ASSERT(wpp->curline->ipc == 0);  // 무효 페이지(ipc)가 0이어야 함
-			list_add_tail(&wpp->curline->entry, &lm->full_line_list);  // Full 라인 리스트에 추가
-			lm->full_line_cnt++;
-			NVMEV_DEBUG_VERBOSE("wpp: move line to full_line_list\n");
-		} else {
-			/* 일부 페이지가 쓰자마자 무효화됨(Overwrite 등): 이 라인은 Victim 후보 */
-			NVMEV_DEBUG_VERBOSE("wpp: line is moved to victim list\n");
-			NVMEV_ASSERT(wpp->curline->vpc >= 0 && wpp->curline->vpc < spp->pgs_per_line);  
-			/* there must be some invalid pages in this line */
-			NVMEV_ASSERT(wpp->curline->ipc > 0);  // 무효 페이지가 최소 하나는 있어야 함
-			// pqueue에 삽입 (victim 후보)
-			pqueue_insert(lm->victim_line_pq, wpp->curline);
-			lm->victim_line_cnt++;
-		}
-
-		/* 8. 새 라인 할당 */
-		/* current line is used up, pick another empty line */
-		check_addr(wpp->blk, spp->blks_per_pl_tlc);
-
-		// 비어있는 새로운 라인을 할당받음 (Free Line -> Active Line)
-		wpp->curline = get_next_free_line(conv_ftl);
-		NVMEV_DEBUG_VERBOSE("wpp: got new clean line %d\n", wpp->curline->id);
-		wpp->blk = wpp->curline->id;  // 새 블록 번호 업데이트
-		check_addr(wpp->blk, spp->blks_per_pl_tlc);
-	} else {
-		/* 2. 페이지 번호 증가 */
-		check_addr(wpp->pg, spp->pgs_per_blk_slc);  // 현재 페이지 번호가 블록 범위를 넘지 않는지 검사
-		wpp->pg++;  // 페이지 번호 1 증가 (4KB)
-
-		/* 3. 워드라인 완료 체크 */
-		// pgs_per_oneshotpg: 한 번에 물리적으로 기록되는 페이지 묶음
-		if ((wpp->pg % spp->pgs_per_oneshotpg_slc) != 0)  // 4KB 페이지를 하나 썼는데 아직 WL이 안 끝났다면 그냥 나감(out)
-			goto out;
-		/* 4. 채널 이동 (스트라이핑) */
-		// WL을 다 채웠다면 병렬성을 위해 다음 채널로 이동
-		wpp->pg -= spp->pgs_per_oneshotpg_slc;  // 페이지 번호를 해당 워드라인의 시작점으로 되돌림
-		check_addr(wpp->ch, spp->nchs);  // 채널 범위에 있는지 확인
-		wpp->ch++;  // 다음 채널로 이동
-		if (wpp->ch != spp->nchs)  // 아직 모든 채널을 다 돌지 않았다면 다음 채널에서 쓰기 위해 나감
-			goto out;
-
-			/* 5. LUN 이동 */
-		wpp->ch = 0;  // 모든 채널을 다 돌았으므로 다시 0번 채널로 리셋
-		check_addr(wpp->lun, spp->luns_per_ch);
-		wpp->lun++;  // 해당 채널의 다음 LUN으로 이동
-		/* in this case, we should go to next lun */
-		if (wpp->lun != spp->luns_per_ch)  // 아직 모든 LUN을 다 돌지 않았다면 나감
-			goto out;
-
-		/* 6. 다음 워드라인으로 진입 */
-		wpp->lun = 0;  // 모든 LUN까지 다 돌았으므로 다시 0번 LUN으로 리셋
-		/* 이제 현재 블록 내에서 다음 수직 위치로 페이지 번호를 점프시킴 */
-		/* go to next wordline in the block */
-		wpp->pg += spp->pgs_per_oneshotpg_slc;
-		if (wpp->pg != spp->pgs_per_blk_slc) // 블록의 끝에 도달하지 않았다면 다음 워드라인 시작
-			goto out;
-
-		/* 7. 라인(Line/Superblock) 소모 및 관리 */
-		// 여기까지 왔다면 현재 사용 중인 라인(모든 채널/LUN의 해당 블록들)을 모두 쓴 것
-		wpp->pg = 0;  // 페이지 번호 초기화
-
-		//현재 라인의 유효 페이지 수(vpc)를 확인하여 상태 분류
-		/* move current line to {victim,full} line list */
-		if (wpp->curline->vpc == spp->pgs_per_line_slc) {
-			/* all pgs are still valid, move to full line list */
-			/* 모든 페이지가 유효하다면, 이 라인은 아주 깨끗하게 꽉 찬 상태 (FULL) */
-			NVMEV_ASSERT(wpp->curline->ipc == 0);  // 무효 페이지(ipc)가 0이어야 함
-			list_add_tail(&wpp->curline->entry, &slm->full_line_list);  // Full 라인 리스트에 추가
-			slm->full_line_cnt++;
-			NVMEV_DEBUG_VERBOSE("wpp: move line to full_line_list\n");
-		} else {
-			/* 일부 페이지가 쓰자마자 무효화됨(Overwrite 등): 이 라인은 Victim 후보 */
-			NVMEV_DEBUG_VERBOSE("wpp: line is moved to victim list\n");
-			NVMEV_ASSERT(wpp->curline->vpc >= 0 && wpp->curline->vpc < spp->pgs_per_line_slc);  
-			/* there must be some invalid pages in this line */
-			NVMEV_ASSERT(wpp->curline->ipc > 0);  // 무효 페이지가 최소 하나는 있어야 함
-			// pqueue에 삽입 (victim 후보)
-			pqueue_insert(slm->victim_line_pq, wpp->curline);
-			slm->victim_line_cnt++;
-		}
-
-		/* 8. 새 라인 할당 */
-		/* current line is used up, pick another empty line */
-		check_addr(wpp->blk, spp->blks_per_pl_slc);
-
-		// 비어있는 새로운 라인을 할당받음 (Free Line -> Active Line)
-		wpp->curline = get_next_free_line_slc(conv_ftl);
-		NVMEV_DEBUG_VERBOSE("wpp: got new clean line %d\n", wpp->curline->id);
-		wpp->blk = wpp->curline->id;  // 새 블록 번호 업데이트
-		check_addr(wpp->blk, spp->blks_per_pl_slc);
-	}
+	check_addr(wpp->blk - lm->lines[0].id, lm->tt_lines);
 
 	/* 9. 무결성 검사 */
 	/* make sure we are starting from page 0 in the super block */
@@ -547,10 +626,9 @@ out:
 			wpp->ch, wpp->lun, wpp->pl, wpp->blk, wpp->pg, wpp->curline->id);
 }
 
-static struct ppa get_new_page(struct conv_ftl *conv_ftl, uint32_t io_type)
+static struct ppa __get_new_page(struct write_pointer *wp)
 {
 	struct ppa ppa;
-	struct write_pointer *wp = __get_wp(conv_ftl, io_type);
 
 	ppa.ppa = 0;
 	ppa.g.ch = wp->ch;
@@ -564,12 +642,22 @@ static struct ppa get_new_page(struct conv_ftl *conv_ftl, uint32_t io_type)
 	return ppa;
 }
 
+static inline struct ppa get_new_page(struct conv_ftl *conv_ftl, uint32_t io_type)
+{
+	return __get_new_page(__get_wp(conv_ftl, io_type));
+}
+
+static inline struct ppa get_new_page_slc(struct conv_ftl *conv_ftl)
+{
+	return __get_new_page(&conv_ftl->swp);
+}
+
 static void init_maptbl(struct conv_ftl *conv_ftl)
 {
 	int i;
 	struct ssdparams *spp = &conv_ftl->ssd->sp;
 
-	conv_ftl->maptbl = vmalloc(sizeof(struct ppa) * spp->tt_pgs);
+	conv_ftl->maptbl = vmalloc_node(sizeof(struct ppa) * spp->tt_pgs, conv_ftl->numa_node);
 	for (i = 0; i < spp->tt_pgs; i++) {
 		conv_ftl->maptbl[i].ppa = UNMAPPED_PPA;
 	}
@@ -585,7 +673,7 @@ static void init_rmap(struct conv_ftl *conv_ftl)
 	int i;
 	struct ssdparams *spp = &conv_ftl->ssd->sp;
 
-	conv_ftl->rmap = vmalloc(sizeof(uint64_t) * spp->tt_pgs);
+	conv_ftl->rmap = vmalloc_node(sizeof(uint64_t) * spp->tt_pgs, conv_ftl->numa_node);
 	for (i = 0; i < spp->tt_pgs; i++) {
 		conv_ftl->rmap[i] = INVALID_LPN;
 	}
@@ -596,12 +684,20 @@ static void remove_rmap(struct conv_ftl *conv_ftl)
 	vfree(conv_ftl->rmap);
 }
 
-static void conv_init_ftl(struct conv_ftl *conv_ftl, struct convparams *cpp, struct ssd *ssd)
+static void conv_init_ftl(struct conv_ftl *conv_ftl, struct convparams *cpp, struct ssd *ssd,
+			  int numa_node)
 {
 	/*copy convparams*/
 	conv_ftl->cp = *cpp;
 
 	conv_ftl->ssd = ssd;
+	conv_ftl->numa_node = numa_node;
+	conv_ftl->gc_cnt = 0;
+	conv_ftl->pg_cnt = 0;
+	conv_ftl->bg_gc_cnt = 0;
+	conv_ftl->mig_cnt = 0;
+
+	spin_lock_init(&conv_ftl->lock);
 
 	/* initialize maptbl */
 	init_maptbl(conv_ftl); // mapping table
@@ -615,6 +711,12 @@ static void conv_init_ftl(struct conv_ftl *conv_ftl, struct convparams *cpp, str
 	/* initialize write pointer, this is how we allocate new pages for writes */
 	prepare_write_pointer(conv_ftl, USER_IO);
 	prepare_write_pointer(conv_ftl, GC_IO);
+	if (SLC_CACHE_MODE == ENABLE_SLC_CACHE) {
+		prepare_write_pointer(conv_ftl, MIGRATION_IO);
+		prepare_write_pointer_slc(conv_ftl);
+	} else {
+		conv_ftl->swp.curline = NULL;
+	}
 
 	init_write_flow_control(conv_ftl);
 
@@ -631,15 +733,42 @@ static void conv_remove_ftl(struct conv_ftl *conv_ftl)
 	remove_maptbl(conv_ftl);
 }
 
-static void conv_init_params(struct convparams *cpp)
+static void conv_init_params(struct convparams *cpp, uint32_t tt_lines)
 {
+	struct nvmev_config *cfg = &nvmev_vdev->config;
+
 	cpp->op_area_pcent = OP_AREA_PERCENT;
 	cpp->gc_thres_lines = 2; /* Need only two lines.(host write, gc)*/
 	cpp->gc_thres_lines_high = 2; /* Need only two lines.(host write, gc)*/
 	cpp->enable_gc_delay = 1;
+	/* Stay above the foreground threshold, otherwise the host hits GC first */
+	cpp->bg_gc_thres_lines_high = 0;
+	cpp->bg_gc_thres_lines_low = 0;
+	if (cfg->bg_gc_high) {
+		cpp->bg_gc_thres_lines_high = max_t(uint32_t, tt_lines * cfg->bg_gc_high / 100,
+						    cpp->gc_thres_lines_high + 1);
+		cpp->bg_gc_thres_lines_low = clamp_t(uint32_t, tt_lines * cfg->bg_gc_low / 100,
+						     cpp->gc_thres_lines_high,
+						     cpp->bg_gc_thres_lines_high);
+	}
 	cpp->pba_pcent = (int)((1 + cpp->op_area_pcent) * 100);
 }
 
+/*
+ * Partitions are spread over the nodes of the dispatchers, which walk the
+ * mapping tables on every I/O. Without ftl_numa_local, the allocator decides.
+ */
+static int __partition_node(uint32_t part)
+{
+	struct nvmev_config *cfg = &nvmev_vdev->config;
+	unsigned int cpu_nr = cfg->cpu_nr_dispatchers[part % cfg->nr_dispatchers];
+
+	if (!cfg->ftl_numa_local || cpu_nr == -1)
+		return NUMA_NO_NODE;
+
+	return cpu_to_node(cpu_nr);
+}
+
 void conv_init_namespace(struct nvmev_ns *ns, uint32_t id, uint64_t size, void *mapped_addr,
 			 uint32_t cpu_nr_dispatcher)
 {
@@ -657,18 +786,20 @@ void conv_init_namespace(struct nvmev_ns *ns, uint32_t id, uint64_t size, void *
 	else{
 		ssd_init_params_slc(&spp, size, nr_parts);
 	}
-	conv_init_params(&cpp);
+	conv_init_params(&cpp, SLC_CACHE_MODE == UNENABLE_SLC_CACHE ? spp.tt_lines : spp.tt_lines_tlc);
 
 	/* 2. FTL 및 SSD 객체 할당 */
 	// 파티션 개수만큼 FTL 구조체 배열을 커널 메모리에 할당
 	conv_ftls = kmalloc(sizeof(struct conv_ftl) * nr_parts, GFP_KERNEL);
 
 	for (i = 0; i < nr_parts; i++) {
+		int node = __partition_node(i);
+
 		// 각 파티션을 담당할 SSD 구조체 할당
-		ssd = kmalloc(sizeof(struct ssd), GFP_KERNEL);
+		ssd = kmalloc_node(sizeof(struct ssd), GFP_KERNEL, node);
 		// SSD
 		ssd_init(ssd, &spp, cpu_nr_dispatcher);
-		conv_init_ftl(&conv_ftls[i], &cpp, ssd);
+		conv_init_ftl(&conv_ftls[i], &cpp, ssd, node);
 	}
 
 	/* PCIe, Write buffer are shared by all instances*/
@@ -681,6 +812,11 @@ void conv_init_namespace(struct nvmev_ns *ns, uint32_t id, uint64_t size, void *
 		conv_ftls[i].ssd->write_buffer = conv_ftls[0].ssd->write_buffer;
 	}
 
+	/* The SLC region is a cache in front of the TLC one and adds no capacity */
+	if (SLC_CACHE_MODE == ENABLE_SLC_CACHE)
+		size = min_t(uint64_t, size, (uint64_t)spp.blks_per_pl_tlc * spp.pls_per_lun *
+					     spp.tt_luns * spp.pgs_per_blk * spp.pgsz * nr_parts);
+
 	ns->id = id;
 	ns->csi = NVME_CSI_NVM;
 	ns->nr_parts = nr_parts;
@@ -689,6 +825,7 @@ void conv_init_namespace(struct nvmev_ns *ns, uint32_t id, uint64_t size, void *
 	ns->mapped = mapped_addr;  // 가상 SSD의 실제 메모리 시작 주소 저장
 	/*register io command handler*/
 	ns->proc_io_cmd = conv_proc_nvme_io_cmd;
+	ns->proc_idle = conv_proc_idle;
 
 	NVMEV_INFO("FTL physical space: %lld, logical space: %lld (physical/logical * 100 = %d)\n",
 		   size, ns->size, cpp.pba_pcent);
@@ -769,14 +906,29 @@ static inline bool mapped_ppa(struct ppa *ppa)
 
 static inline struct line *get_line(struct conv_ftl *conv_ftl, struct ppa *ppa)
 {
-	return &(conv_ftl->lm.lines[ppa->g.blk]);
+	if (is_slc_blk(conv_ftl->ssd, ppa))
+		return &(conv_ftl->slm.lines[ppa->g.blk]);
+
+	return &(conv_ftl->lm.lines[ppa->g.blk - conv_ftl->ssd->sp.blks_per_pl_slc]);
+}
+
+/* SLC and TLC lines are managed separately */
+static inline struct line_mgmt *get_line_mgmt(struct conv_ftl *conv_ftl, struct ppa *ppa)
+{
+	return is_slc_blk(conv_ftl->ssd, ppa) ? &conv_ftl->slm : &conv_ftl->lm;
+}
+
+static inline unsigned long pgs_per_line(struct conv_ftl *conv_ftl, struct ppa *ppa)
+{
+	struct ssdparams *spp = &conv_ftl->ssd->sp;
+	return is_slc_blk(conv_ftl->ssd, ppa) ? spp->pgs_per_line_slc : spp->pgs_per_line;
 }
 
 /* update SSD status about one page from PG_VALID -> PG_VALID */
 static void mark_page_invalid(struct conv_ftl *conv_ftl, struct ppa *ppa)
 {
-	struct ssdparams *spp = &conv_ftl->ssd->sp;
-	struct line_mgmt *lm = &conv_ftl->lm;
+	struct line_mgmt *lm = get_line_mgmt(conv_ftl, ppa);
+	const unsigned long line_pgs = pgs_per_line(conv_ftl, ppa);
 	struct nand_block *blk = NULL;
 	struct nand_page *pg = NULL;
 	bool was_full_line = false;  // 이 라인이 방금 전까지 100% 꽉 찬 상태였는지 체크용
@@ -789,22 +941,22 @@ static void mark_page_invalid(struct conv_ftl *conv_ftl, struct ppa *ppa)
 
 	/* [STEP 2] update corresponding (physical) block status */
 	blk = get_blk(conv_ftl->ssd, ppa);  // 해당 페이지가 속한 물리 블록을 찾음
-	NVMEV_ASSERT(blk->ipc >= 0 && blk->ipc < spp->pgs_per_blk);  // 무효 페이지가 0 이상인지 확인 && 무효 페이지 개수가 블록의 전체 페이지 수 미만인지 확인
+	NVMEV_ASSERT(blk->ipc >= 0 && blk->ipc < blk->npgs);  // 무효 페이지가 0 이상인지 확인 && 무효 페이지 개수가 블록의 전체 페이지 수 미만인지 확인
 	blk->ipc++;			// 블록 내 무효 페이지 수(Invalid Page Count) 1 증가
-	NVMEV_ASSERT(blk->vpc > 0 && blk->vpc <= spp->pgs_per_blk);  // 유효 페이지가 있는지 확인
+	NVMEV_ASSERT(blk->vpc > 0 && blk->vpc <= blk->npgs);  // 유효 페이지가 있는지 확인
 	blk->vpc--;  // 블록 내 유효 페이지 수(Valid Page Count) 1 감소
 
 	/* [STEP 3] update corresponding line status */
 	line = get_line(conv_ftl, ppa);  // 해당 페이지가 속한 라인(여러 블록의 묶음)을 찾음
-	NVMEV_ASSERT(line->ipc >= 0 && line->ipc < spp->pgs_per_line);
+	NVMEV_ASSERT(line->ipc >= 0 && line->ipc < line_pgs);
 
   // 만약 현재 유효 페이지(vpc)가 전체 페이지 수와 같다면, 이 라인은 방금 전까지 100% 유효한 'Full' 상태였음
-	if (line->vpc == spp->pgs_per_line) {
+	if (line->vpc == line_pgs) {
 		NVMEV_ASSERT(line->ipc == 0);
 		was_full_line = true;
 	}
 	line->ipc++;  // 라인 전체의 무효 페이지 수 1 증가
-	NVMEV_ASSERT(line->vpc > 0 && line->vpc <= spp->pgs_per_line);
+	NVMEV_ASSERT(line->vpc > 0 && line->vpc <= line_pgs);
 
 
 	/* [STEP 4] Adjust the position of the victim line in the pq under over-writes */
@@ -817,7 +969,12 @@ static void mark_page_invalid(struct conv_ftl *conv_ftl, struct ppa *ppa)
      * Greedy GC에서는 VPC가 낮을수록 우선순위가 높으므로, 이 라인은 큐의 위쪽(청소 1순위 쪽)으로 이동합니다.
      * [참고]: 이 함수 호출 내부에서 line->vpc 값도 실제로 1 감소시킵니다.
      */
-		pqueue_change_priority(lm->victim_line_pq, line->vpc - 1, line);
+		if (uses_cb_index(conv_ftl, lm))
+			cb_invalidate(lm, line);
+		else if (uses_vpc_buckets(conv_ftl, lm))
+			vb_invalidate(lm, line);
+		else
+			pqueue_change_priority(lm->victim_line_pq, line->vpc - 1, line);
 	} else {
 		// 만약 PQ에 없다면(Active 라인이거나 Full 리스트에 있다면) 그냥 VPC 숫자만 줄임
 		line->vpc--;
@@ -831,14 +988,13 @@ static void mark_page_invalid(struct conv_ftl *conv_ftl, struct ppa *ppa)
 		lm->full_line_cnt--;  // Full 라인 개수 감소
 
 		// 이제 공식적인 청소 후보가 되었으므로 PQ에 처음으로 삽입
-		pqueue_insert(lm->victim_line_pq, line);
+		insert_victim_line(conv_ftl, lm, line);
 		lm->victim_line_cnt++;  // Victim 라인 개수 증가
 	}
 }
 
 static void mark_page_valid(struct conv_ftl *conv_ftl, struct ppa *ppa)
 {
-	struct ssdparams *spp = &conv_ftl->ssd->sp;
 	struct nand_block *blk = NULL;
 	struct nand_page *pg = NULL;
 	struct line *line;
@@ -850,12 +1006,12 @@ static void mark_page_valid(struct conv_ftl *conv_ftl, struct ppa *ppa)
 
 	/* update corresponding block status */
 	blk = get_blk(conv_ftl->ssd, ppa);
-	NVMEV_ASSERT(blk->vpc >= 0 && blk->vpc < spp->pgs_per_blk);
+	NVMEV_ASSERT(blk->vpc >= 0 && blk->vpc < blk->npgs);
 	blk->vpc++;
 
 	/* update corresponding line status */
 	line = get_line(conv_ftl, ppa);
-	NVMEV_ASSERT(line->vpc >= 0 && line->vpc < spp->pgs_per_line);
+	NVMEV_ASSERT(line->vpc >= 0 && line->vpc < pgs_per_line(conv_ftl, ppa));
 	line->vpc++;
 }
 
@@ -866,7 +1022,7 @@ static void mark_block_free(struct conv_ftl *conv_ftl, struct ppa *ppa)
 	struct nand_page *pg = NULL;
 	int i;
 
-	for (i = 0; i < spp->pgs_per_blk; i++) {
+	for (i = 0; i < blk->npgs; i++) {
 		/* reset page status */
 		pg = &blk->pg[i];
 		NVMEV_ASSERT(pg->nsecs == spp->secs_per_pg);
@@ -874,7 +1030,6 @@ static void mark_block_free(struct conv_ftl *conv_ftl, struct ppa *ppa)
 	}
 
 	/* reset block status */
-	NVMEV_ASSERT(blk->npgs == spp->pgs_per_blk);
 	blk->ipc = 0;
 	blk->vpc = 0;
 	blk->erase_cnt++;
@@ -898,8 +1053,8 @@ static void gc_read_page(struct conv_ftl *conv_ftl, struct ppa *ppa)
 	}
 }
 
-/* move valid page data (already in DRAM) from victim line to a new page */
-static uint64_t gc_write_page(struct conv_ftl *conv_ftl, struct ppa *old_ppa)
+/* move valid page data (already in DRAM) from victim line to a new page of GC_IO or MIGRATION_IO */
+static uint64_t gc_write_page(struct conv_ftl *conv_ftl, struct ppa *old_ppa, uint32_t io_type)
 {
 	struct ssdparams *spp = &conv_ftl->ssd->sp;
 	struct convparams *cpp = &conv_ftl->cp;
@@ -907,7 +1062,7 @@ static uint64_t gc_write_page(struct conv_ftl *conv_ftl, struct ppa *old_ppa)
 	uint64_t lpn = get_rmap_ent(conv_ftl, old_ppa);
 
 	NVMEV_ASSERT(valid_lpn(conv_ftl, lpn));
-	new_ppa = get_new_page(conv_ftl, GC_IO);
+	new_ppa = get_new_page(conv_ftl, io_type);
 	/* update maptbl */
 	set_maptbl_ent(conv_ftl, lpn, &new_ppa);
 	/* update rmap */
@@ -916,11 +1071,11 @@ static uint64_t gc_write_page(struct conv_ftl *conv_ftl, struct ppa *old_ppa)
 	mark_page_valid(conv_ftl, &new_ppa);
 
 	/* need to advance the write pointer here */
-	advance_write_pointer(conv_ftl, GC_IO);
+	advance_write_pointer(conv_ftl, __get_wp(conv_ftl, io_type), &conv_ftl->lm);
 
 	if (cpp->enable_gc_delay) {
 		struct nand_cmd gcw = {
-			.type = GC_IO,
+			.type = io_type,
 			.cmd = NAND_NOP,
 			.stime = 0,
 			.interleave_pci_dma = false,
@@ -954,9 +1109,9 @@ static struct line *select_victim_line(struct conv_ftl *conv_ftl, bool force)
 
 	// kimi added
 	if (GC_MODE == GREEDY)
-		victim_line = pqueue_peek(lm->victim_line_pq);
+		victim_line = peek_greedy_victim(conv_ftl, lm);
 	else if (GC_MODE == COST_BENEFIT)
-		victim_line = cost_benefit_select(lm->victim_line_pq);
+		victim_line = cb_select(lm);
 	else if (GC_MODE == RANDOM)
 		victim_line = random_select(lm->victim_line_pq);
 	// kimi added
@@ -970,8 +1125,10 @@ static struct line *select_victim_line(struct conv_ftl *conv_ftl, bool force)
 	}
 
 	if (GC_MODE == GREEDY)
-		pqueue_pop(lm->victim_line_pq);
-	else if (GC_MODE == COST_BENEFIT || GC_MODE == RANDOM)
+		remove_greedy_victim(conv_ftl, lm, victim_line);
+	else if (GC_MODE == COST_BENEFIT)
+		__cb_del(lm, victim_line);
+	else if (GC_MODE == RANDOM)
 		pqueue_remove(lm->victim_line_pq, victim_line);
 
 
@@ -998,7 +1155,7 @@ static void clean_one_block(struct conv_ftl *conv_ftl, struct ppa *ppa)
 		if (pg_iter->status == PG_VALID) {
 			gc_read_page(conv_ftl, ppa);
 			/* delay the maptbl update until "write" happens */
-			gc_write_page(conv_ftl, ppa);
+			gc_write_page(conv_ftl, ppa, GC_IO);
 			cnt++;
 		}
 	}
@@ -1009,7 +1166,7 @@ static void clean_one_block(struct conv_ftl *conv_ftl, struct ppa *ppa)
 /* here ppa identifies the block we want to clean */
 /* 하나의 flashpg(16KB) 내부에 들어있는 여러 물리 페이지들(4KB)을 검사해서
    유효한 데이터(PG_VALID)가 있다면 다른 곳으로 이동시키는(GC Write) 함수 */
-static void clean_one_flashpg(struct conv_ftl *conv_ftl, struct ppa *ppa)
+static void clean_one_flashpg(struct conv_ftl *conv_ftl, struct ppa *ppa, uint32_t io_type)
 {
 	struct ssdparams *spp = &conv_ftl->ssd->sp; // SSD의 물리적 특성 파라미터 가져오기
 	struct convparams *cpp = &conv_ftl->cp;  // FTL 설정값 가져오기
@@ -1042,7 +1199,7 @@ static void clean_one_flashpg(struct conv_ftl *conv_ftl, struct ppa *ppa)
 	// [STEP 2] 유효한 데이터 읽기 작업 시뮬레이션 (지연 시간 반영)
 	if (cpp->enable_gc_delay) {
 		struct nand_cmd gcr = {
-			.type = GC_IO,
+			.type = io_type,
 			.cmd = NAND_READ,  // 유효 데이터를 읽어야 이사를 보내므로 READ 명령
 			.stime = 0,
 			.xfer_size = spp->pgsz * cnt,  // 유효 페이지 개수만큼 데이터 크기 설정
@@ -1062,8 +1219,9 @@ static void clean_one_flashpg(struct conv_ftl *conv_ftl, struct ppa *ppa)
 		if (pg_iter->status == PG_VALID) {
 			/* delay the maptbl update until "write" happens */
 			/* 이 함수가 새로운 빈 블록을 찾아 데이터를 쓰고 매핑 테이블 업데이트 */
-			gc_write_page(conv_ftl, &ppa_copy);
-			conv_ftl->pg_cnt++;
+			gc_write_page(conv_ftl, &ppa_copy, io_type);
+			if (io_type == GC_IO)
+				conv_ftl->pg_cnt++;
 		}
 
 		ppa_copy.g.pg++; // 다음 페이지로 이동
@@ -1072,7 +1230,7 @@ static void clean_one_flashpg(struct conv_ftl *conv_ftl, struct ppa *ppa)
 
 static void mark_line_free(struct conv_ftl *conv_ftl, struct ppa *ppa)
 {
-	struct line_mgmt *lm = &conv_ftl->lm;
+	struct line_mgmt *lm = get_line_mgmt(conv_ftl, ppa);
 	struct line *line = get_line(conv_ftl, ppa);
 	line->ipc = 0;
 	line->vpc = 0;
@@ -1081,36 +1239,22 @@ static void mark_line_free(struct conv_ftl *conv_ftl, struct ppa *ppa)
 	lm->free_line_cnt++;
 }
 
-static int do_gc(struct conv_ftl *conv_ftl, bool force)
+/* copy the valid pages of a line out with io_type and erase it */
+static void reclaim_line(struct conv_ftl *conv_ftl, struct line *victim_line, uint32_t io_type)
 {
-	struct line *victim_line = NULL;
 	struct ssdparams *spp = &conv_ftl->ssd->sp; 
 	struct ppa ppa; // 물리 주소 구조체
+	int flashpgs_per_blk;
 	int flashpg;
 
-
-	// Select GC line.
-	victim_line = select_victim_line(conv_ftl, force);
-	if (!victim_line) {
-		return -1; // Exit if the line doesn't exist.
-	}
-
-
-	conv_ftl->gc_cnt++;
-
+	ppa.ppa = 0;
 	ppa.g.blk = victim_line->id; // 선택된 Victim 라인의 ID를 물리 블록 번호로 설정
-
-	// 현재 GC 상태(IPC, VPC, 프리 라인 개수 등)를 디버그 메시지로 출력
-	NVMEV_DEBUG_VERBOSE("GC-ing line:%d,ipc=%d(%d),victim=%d,full=%d,free=%d\n", ppa.g.blk,
-		    victim_line->ipc, victim_line->vpc, conv_ftl->lm.victim_line_cnt,
-		    conv_ftl->lm.full_line_cnt, conv_ftl->lm.free_line_cnt);
-
-	// ipc 만큼 나중에 데이터를 더 쓸 수 있도록 '크레딧'을 보충
-	conv_ftl->wfc.credits_to_refill = victim_line->ipc;
+	flashpgs_per_blk = is_slc_blk(conv_ftl->ssd, &ppa) ? spp->flashpgs_per_blk_slc :
+							     spp->flashpgs_per_blk;
 
 	/* copy back valid data */
 	// 라인 내의 모든 플래시 페이지(flashpg) 순회
-	for (flashpg = 0; flashpg < spp->flashpgs_per_blk; flashpg++) {
+	for (flashpg = 0; flashpg < flashpgs_per_blk; flashpg++) {
 		int ch, lun;
 
 		ppa.g.pg = flashpg * spp->pgs_per_flashpg; // 현재 조사할 페이지 번호 설정
@@ -1128,10 +1272,10 @@ static int do_gc(struct conv_ftl *conv_ftl, bool force)
 
 				// [핵심] 유효한 데이터가 있다면 다른 곳으로 복사 후 페이지 비우기
 				// 'Valid Page Copy' 발생
-				clean_one_flashpg(conv_ftl, &ppa);
+				clean_one_flashpg(conv_ftl, &ppa, io_type);
 
 				// 해당 블록의 마지막 페이지까지 다 확인했으면 
-				if (flashpg == (spp->flashpgs_per_blk - 1)) {
+				if (flashpg == (flashpgs_per_blk - 1)) {
 					struct convparams *cpp = &conv_ftl->cp;
 
 					// 블록을 프리상태로 표시
@@ -1140,7 +1284,7 @@ static int do_gc(struct conv_ftl *conv_ftl, bool force)
 					// GC 지연 시뮬레이션이 활성화되어 있다면 실제로 NAND 소거(Erase) 명령 보내기
 					if (cpp->enable_gc_delay) {
 						struct nand_cmd gce = {
-							.type = GC_IO,
+							.type = io_type,
 							.cmd = NAND_ERASE,  // NAND 소거 명령
 							.stime = 0,
 							.interleave_pci_dma = false,
@@ -1159,6 +1303,74 @@ static int do_gc(struct conv_ftl *conv_ftl, bool force)
 	/* update line status */
 	// 전체 라인을 프리 라인 풀(Free pool)로 되돌려주어 다시 쓸 수 있게 만듦
 	mark_line_free(conv_ftl, &ppa);
+}
+
+/* Only foreground GC sizes the next write credit refill, idle-time GC leaves it alone */
+static int do_gc(struct conv_ftl *conv_ftl, bool force, bool foreground)
+{
+	struct line *victim_line = NULL;
+
+	// Select GC line.
+	victim_line = select_victim_line(conv_ftl, force);
+	if (!victim_line) {
+		return -1; // Exit if the line doesn't exist.
+	}
+
+
+	conv_ftl->gc_cnt++;
+
+	// 현재 GC 상태(IPC, VPC, 프리 라인 개수 등)를 디버그 메시지로 출력
+	NVMEV_DEBUG_VERBOSE("GC-ing line:%d,ipc=%d(%d),victim=%d,full=%d,free=%d\n", victim_line->id,
+		    victim_line->ipc, victim_line->vpc, conv_ftl->lm.victim_line_cnt,
+		    conv_ftl->lm.full_line_cnt, conv_ftl->lm.free_line_cnt);
+
+	// ipc 만큼 나중에 데이터를 더 쓸 수 있도록 '크레딧'을 보충
+	if (foreground)
+		conv_ftl->wfc.credits_to_refill = victim_line->ipc;
+
+	reclaim_line(conv_ftl, victim_line, GC_IO);
+
+	return 0;
+}
+
+/*
+ * Fold an SLC line into the TLC region. Lines with the fewest valid pages go first,
+ * then the oldest full ones. The host gets the SLC write pointer back once a line is free.
+ */
+static int migrate_slc_line(struct conv_ftl *conv_ftl)
+{
+	struct line_mgmt *slm = &conv_ftl->slm;
+	struct line *line = peek_greedy_victim(conv_ftl, slm);
+	uint32_t nr_migrated;
+
+	if (line) {
+		remove_greedy_victim(conv_ftl, slm, line);
+		line->pos = 0;
+		slm->victim_line_cnt--;
+	} else {
+		line = list_first_entry_or_null(&slm->full_line_list, struct line, entry);
+		if (!line)
+			return -1;
+		list_del_init(&line->entry);
+		slm->full_line_cnt--;
+	}
+
+	NVMEV_DEBUG_VERBOSE("Migrating SLC line:%d,vpc=%d,free=%d\n", line->id, line->vpc,
+			    slm->free_line_cnt);
+
+	nr_migrated = line->vpc;
+	reclaim_line(conv_ftl, line, MIGRATION_IO);
+	conv_ftl->mig_cnt++;
+
+	/*
+	 * Migrated pages take TLC space as host writes do, so they pay credits
+	 * for GC too. Only once the line is done, not to nest GC in it.
+	 */
+	conv_ftl->wfc.write_credits -= min(conv_ftl->wfc.write_credits, nr_migrated);
+	check_and_refill_write_credit(conv_ftl);
+
+	if (!conv_ftl->swp.curline)
+		prepare_write_pointer_slc(conv_ftl);
 
 	return 0;
 }
@@ -1168,8 +1380,65 @@ static void foreground_gc(struct conv_ftl *conv_ftl)
 	if (should_gc_high(conv_ftl)) {
 		NVMEV_DEBUG_VERBOSE("should_gc_high passed");
 		/* perform GC here until !should_gc(conv_ftl) */
-		do_gc(conv_ftl, true);
+		do_gc(conv_ftl, true, true);
+	}
+}
+
+static inline bool should_bg_gc(struct conv_ftl *conv_ftl)
+{
+	return READ_ONCE(conv_ftl->lm.free_line_cnt) < conv_ftl->cp.bg_gc_thres_lines_high;
+}
+
+static inline bool should_migrate(struct conv_ftl *conv_ftl)
+{
+	return SLC_CACHE_MODE == ENABLE_SLC_CACHE &&
+	       READ_ONCE(conv_ftl->slm.free_line_cnt) < conv_ftl->slm.tt_lines;
+}
+
+/*
+ * Reclaim a TLC line or migrate an SLC line ahead of demand while every LUN of the
+ * partition is idle. The commands start now and occupy the LUNs, so the next call
+ * waits for them to finish and host I/O arriving meanwhile queues behind them as on
+ * a real drive. TLC space comes first so that migration has somewhere to go.
+ */
+static void background_gc(struct conv_ftl *conv_ftl)
+{
+	struct convparams *cpp = &conv_ftl->cp;
+
+	if (!should_bg_gc(conv_ftl) && !should_migrate(conv_ftl))
+		return;
+
+	if (!spin_trylock(&conv_ftl->lock))
+		return;
+
+	if (ssd_next_idle_time(conv_ftl->ssd) > nvmev_clock())
+		goto out;
+
+	if (should_bg_gc(conv_ftl) &&
+	    do_gc(conv_ftl, conv_ftl->lm.free_line_cnt <= cpp->bg_gc_thres_lines_low, false) == 0) {
+		conv_ftl->bg_gc_cnt++;
+		goto out;
 	}
+
+	if (should_migrate(conv_ftl) && conv_ftl->lm.free_line_cnt > cpp->gc_thres_lines_high)
+		migrate_slc_line(conv_ftl);
+
+out:
+	spin_unlock(&conv_ftl->lock);
+}
+
+/* Partitions are assigned to dispatchers the same way as in __partition_node() */
+void conv_proc_idle(struct nvmev_ns *ns, unsigned int dispatcher_id)
+{
+	struct conv_ftl *conv_ftls = (struct conv_ftl *)ns->ftls;
+	const unsigned int nr_dispatchers = nvmev_vdev->config.nr_dispatchers;
+	uint32_t i;
+
+	if (!conv_ftls[0].cp.bg_gc_thres_lines_high && SLC_CACHE_MODE == UNENABLE_SLC_CACHE)
+		return;
+
+	for (i = dispatcher_id; i < ns->nr_parts; i += nr_dispatchers)
+		background_gc(&conv_ftls[i]);
 }
 
 static bool is_same_flash_page(struct conv_ftl *conv_ftl, struct ppa ppa1, struct ppa ppa2)
@@ -1229,6 +1498,8 @@ static bool conv_read(struct nvmev_ns *ns, struct nvmev_request *req, struct nvm
 	for (i = 0; (i < nr_parts) && (start_lpn <= end_lpn); i++, start_lpn++) {
 		conv_ftl = &conv_ftls[start_lpn % nr_parts];	// 해당 LPN을 담당하는 FTL 인스턴스 선택
 		xfer_size = 0;
+
+		spin_lock(&conv_ftl->lock);
 		prev_ppa = get_maptbl_ent(conv_ftl, start_lpn / nr_parts);	// 첫 번째 PPA 주소 획득
 
 		/* normal IO read path */
@@ -1282,6 +1553,7 @@ static bool conv_read(struct nvmev_ns *ns, struct nvmev_request *req, struct nvm
 			nsecs_completed = ssd_advance_nand(conv_ftl->ssd, &srd);
 			nsecs_latest = max(nsecs_completed, nsecs_latest);
 		}
+		spin_unlock(&conv_ftl->lock);
 	}
 
 	/* 9. 최종 결과 반환 */
@@ -1359,12 +1631,15 @@ static bool conv_write(struct nvmev_ns *ns, struct nvmev_request *req, struct nv
 		uint64_t local_lpn;
 		uint64_t nsecs_completed = 0;
 		struct ppa ppa;
+		bool slc;
 
 		/* 파티션 분산: LPN을 파티션 수(nr_parts)로 나눈 나머지로 담당 FTL 결정 -> 병렬처리 가능하게 함 */
 		conv_ftl = &conv_ftls[lpn % nr_parts];
 		/* 해당 FTL 내부에서 사용할 상대적 주소(local LPN) 계산 */
 		local_lpn = lpn / nr_parts;
 
+		spin_lock(&conv_ftl->lock);
+
 		/* [중요 포인트 A: 덮어쓰기 발생!] */
     /* 기존 맵 확인: 이 LPN이 예전에 쓰인 적이 있는지 매핑 테이블을 뒤져봅니다. */
 		ppa = get_maptbl_ent(
@@ -1378,7 +1653,7 @@ static bool conv_write(struct nvmev_ns *ns, struct nvmev_request *req, struct nv
 			if (GC_MODE == COST_BENEFIT){
 				// kimi added
 				struct line *line = get_line(conv_ftl, &ppa);
-				line->age = ktime_get_ns();
+				line->age = nvmev_clock();
 				// kimi added
 			}
 
@@ -1389,7 +1664,9 @@ static bool conv_write(struct nvmev_ns *ns, struct nvmev_request *req, struct nv
 
 		/* new write */
 		/* 10. 새 페이지 할당: 데이터를 실제로 저장할 새로운 빈 물리 공간(ppa)을 할당받음 */
-		ppa = get_new_page(conv_ftl, USER_IO);
+		/* SLC cache first, directly to TLC while it is full */
+		slc = conv_ftl->swp.curline != NULL;
+		ppa = slc ? get_new_page_slc(conv_ftl) : get_new_page(conv_ftl, USER_IO);
 
 		/* 매핑 업데이트: "이제 이 LPN은 이 PPA에 들어있다"고 장부(maptbl, rmap)를 갱신 */
 		/* update maptbl */
@@ -1404,12 +1681,18 @@ static bool conv_write(struct nvmev_ns *ns, struct nvmev_request *req, struct nv
 
 		/* need to advance the write pointer here */
 		/* 11. 쓰기 포인터 전진: 해당 FTL의 다음 빈 페이지 위치를 한 칸(4KB) 옮김 */
-		advance_write_pointer(conv_ftl, USER_IO);
+		if (slc)
+			advance_write_pointer(conv_ftl, &conv_ftl->swp, &conv_ftl->slm);
+		else
+			advance_write_pointer(conv_ftl, &conv_ftl->wp, &conv_ftl->lm);
 
 		/* Aggregate write io in flash page */
 		/* 12. 낸드 실제 쓰기 트리거: 원샷 페이지의 마지막 페이지까지 데이터가 모였는지 확인 */
 		if (last_pg_in_wordline(conv_ftl, &ppa)) {
+			uint32_t pgs = pgs_per_oneshotpg(conv_ftl, &ppa);
+
 			swr.ppa = &ppa;
+			swr.xfer_size = spp->pgsz * pgs;
 
 			/* 낸드 미디어에 실제로 기록되는 지연 시간(latency)을 시뮬레이션에 반영 */
 			nsecs_completed = ssd_advance_nand(conv_ftl->ssd, &swr);
@@ -1418,13 +1701,18 @@ static bool conv_write(struct nvmev_ns *ns, struct nvmev_request *req, struct nv
 
 			/* 스케줄링: 낸드 쓰기가 완료된 후 버퍼를 비우는 내부 작업 예약 */
 			schedule_internal_operation(req->sq_id, nsecs_completed, wbuf,
-						    spp->pgs_per_oneshotpg * spp->pgsz);
+						    pgs * spp->pgsz);
 		}
 
 		/* 13. 쓰기 크레딧(Credit) 관리: 호스트의 쓰기 속도를 제어(Flow control)하기 위해
 					 남은 쓰기 권한을 소모하고, 필요시 GC 상태를 체크하여 보충 */
-		consume_write_credit(conv_ftl);
-		check_and_refill_write_credit(conv_ftl);
+		/* SLC writes take no TLC space until they are migrated at idle time */
+		if (!slc) {
+			consume_write_credit(conv_ftl);
+			check_and_refill_write_credit(conv_ftl);
+		}
+
+		spin_unlock(&conv_ftl->lock);
 	}
 
 	/* 14. 응답 시간 결정 */
@@ -1451,9 +1739,9 @@ static void conv_flush(struct nvmev_ns *ns, struct nvmev_request *req, struct nv
 	uint32_t i;
 	struct conv_ftl *conv_ftls = (struct conv_ftl *)ns->ftls;
 
-	uint64_t gc_cnts = 0, pg_cnts = 0;
+	uint64_t gc_cnts = 0, pg_cnts = 0, bg_gc_cnts = 0, mig_cnts = 0;
 	
-	start = local_clock();
+	start = nvmev_clock();
 	latest = start;
 	for (i = 0; i < ns->nr_parts; i++) {
 		latest = max(latest, ssd_next_idle_time(conv_ftls[i].ssd));
@@ -1465,8 +1753,11 @@ static void conv_flush(struct nvmev_ns *ns, struct nvmev_request *req, struct nv
    for (i = 0; i < ns->nr_parts; i++) {
       gc_cnts += conv_ftls[i].gc_cnt;
       pg_cnts += conv_ftls[i].pg_cnt;
+      bg_gc_cnts += conv_ftls[i].bg_gc_cnt;
+      mig_cnts += conv_ftls[i].mig_cnt;
    }
-   NVMEV_INFO("GC count: %llu\tCopy Page(4KB) Count: %llu\n", gc_cnts, pg_cnts);
+   NVMEV_INFO("GC count: %llu (idle: %llu)\tSLC migration count: %llu\tCopy Page(4KB) Count: %llu\n",
+	      gc_cnts, bg_gc_cnts, mig_cnts, pg_cnts);
 
 	ret->status = NVME_SC_SUCCESS;
 	ret->nsecs_target = latest;
@@ -8,12 +8,21 @@
 #include "ssd_config.h"
 #include "ssd.h"
 
+/* age levels of the cost-benefit GC policy */
+#define CB_AGE_LVLS (7)
 
 struct convparams {
 	uint32_t gc_thres_lines;
 	uint32_t gc_thres_lines_high;
 	bool enable_gc_delay;
 
+	/*
+	 * Idle-time GC runs while free lines are below bg_gc_thres_lines_high. Above
+	 * bg_gc_thres_lines_low, it only takes cheap victims. 0 disables it.
+	 */
+	uint32_t bg_gc_thres_lines_low;
+	uint32_t bg_gc_thres_lines_high;
+
 	double op_area_pcent;
 	int pba_pcent; /* (physical space / logical space) * 100*/
 };
@@ -23,6 +32,7 @@ struct line {
 	int ipc; /* invalid page count in this line */
 	int vpc; /* valid page count in this line */
 	uint64_t age; // kimi added
+	int cb_lvl; /* age level in the cost-benefit victim index */
 	struct list_head entry;
 	/* position in the priority queue for victim lines */
 	size_t pos;
@@ -46,6 +56,20 @@ struct line_mgmt {
 	pqueue_t *victim_line_pq; // partially valid: 
 	struct list_head full_line_list;
 
+	/* Cost-benefit victims of each age level, in a vpc heap and from the oldest */
+	pqueue_t *cb_pq[CB_AGE_LVLS];
+	struct list_head cb_age_list[CB_AGE_LVLS];
+
+	/* Greedy victims listed by vpc, and no victim has less than min_vpc */
+	struct list_head *vpc_buckets;
+	uint32_t nr_vpc_buckets; /* pages per line + 1 */
+	uint32_t min_vpc;
+
+	/* Geometry of the region, SLC or TLC, the lines are in */
+	uint32_t pgs_per_blk;
+	uint32_t pgs_per_oneshotpg;
+	unsigned long pgs_per_line;
+
 	uint32_t tt_lines; // total lines #
 	uint32_t free_line_cnt; // free lines # that can use
 	uint32_t victim_line_cnt;
@@ -65,16 +89,22 @@ struct conv_ftl {  // 각 partition의 LBA -> PPA
 	uint64_t *rmap; /* reverse mapptbl, assume it's stored in OOB */   // GC할 때 사용, DRAM이 아니라 낸드 페이지의 남는 공간(Out-Of-Band)에 저장
 	struct write_pointer wp; // Write pointer: 현재 데이터를 쓰고 있는 지점 (Offset: 4KB)
 	struct write_pointer gc_wp; // GC-Write pointer: GC한 데이터들을 따로 모아놓아야 hot/cold 어느정도 따로 저장됨
+	struct write_pointer mig_wp; /* SLC lines folded into TLC */
 	struct line_mgmt lm;
 	struct write_flow_control wfc; // write credit: line별 남은 페이지수, 쓰기흐름 제어장치 - 호스트의 요청속도를 GC 속도가 못따라가면 SSD가 뻗어버릴 수 있으므로 GC 상태에 따라 호스트의 쓰기 속도 조절하는 용도
 
 	/* kimi added */
 	// garbage collection
 	uint64_t gc_cnt, pg_cnt;
+	uint64_t bg_gc_cnt; /* lines reclaimed while the LUNs were idle */
+	uint64_t mig_cnt; /* SLC lines folded into TLC */
 	
 	// slc cache
 	struct line_mgmt slm;
-	struct write_pointer swp;
+	struct write_pointer swp; /* host writes while curline is not NULL */
+
+	spinlock_t lock; /* serializes dispatchers working on this partition */
+	int numa_node; /* where the metadata is allocated */
 };
 
 void conv_init_namespace(struct nvmev_ns *ns, uint32_t id, uint64_t size, void *mapped_addr,
@@ -85,4 +115,6 @@ void conv_remove_namespace(struct nvmev_ns *ns);
 bool conv_proc_nvme_io_cmd(struct nvmev_ns *ns, struct nvmev_request *req,
 			   struct nvmev_result *ret);
 
+void conv_proc_idle(struct nvmev_ns *ns, unsigned int dispatcher_id);
+
 #endif
@@ -9,46 +9,30 @@
 #include <linux/sched/task.h>
 #include <linux/slab.h>
 
+#include "clock.h"
 #include "dma.h"
 
-// Size of the memcpy test buffer
-static unsigned int test_buf_size = 4096;
-
 // Bus ID of the DMA Engine to test (default: any)
 static char test_device[32];
 
 // Maximum number of channels to use (default: all)
 static unsigned int max_channels;
 
-// Transfer Timeout in msec (default: 3000), Pass -1 for infinite timeout
-static int timeout = 3000;
-
-// Optional custom transfer size in bytes (default: not used (0))
-static unsigned int transfer_size = 1024;
-
-// Use polling for completion instead of interrupts
-static bool polled = true;
+// Large copies are split into chunks of this size to spread them over channels
+#define IOAT_DMA_CHUNK_SIZE (64 * 1024)
 
 #define CHANNEL_NAME_LEN 20
 
 /**
  * struct ioat_dma_params - test parameters.
- * @buf_size:		size of the memcpy test buffer
  * @channel:		bus ID of the channel to test
  * @device:		bus ID of the DMA Engine to test
  * @max_channels:	maximum number of channels to use
- * @timeout:		transfer timeout in msec, -1 for infinite timeout
- * @transfer_size:	custom transfer size in bytes
- * @polled:		use polling for completion instead of interrupts
  */
 struct ioat_dma_params {
-	unsigned int buf_size;
 	char channel[CHANNEL_NAME_LEN];
 	char device[32];
 	unsigned int max_channels;
-	int timeout;
-	unsigned int transfer_size;
-	bool polled;
 };
 
 /**
@@ -56,6 +40,8 @@ struct ioat_dma_params {
  * @params:		test parameters
  * @channels:		channels under test
  * @nr_channels:	number of channels under test
+ * @chans:		the channels, indexed on the data path
+ * @chan_turn:		channel to start the next batch on
  * @lock:		access protection to the fields of this structure
  * @did_init:		module has been initialized completely
  * @last_error:		test has faced configuration issues
@@ -67,6 +53,8 @@ static struct ioat_dma_info {
 	/* Internal state */
 	struct list_head channels;
 	unsigned int nr_channels;
+	struct dma_chan *chans[IOAT_DMA_MAX_CHANNELS];
+	atomic_t chan_turn;
 	int last_error;
 	struct mutex lock;
 	bool did_init;
@@ -75,35 +63,13 @@ static struct ioat_dma_info {
 	.lock = __MUTEX_INITIALIZER(test_info.lock),
 };
 
-struct ioat_dma_done {
-	bool			done;
-	wait_queue_head_t	*wait;
-};
-
-struct ioat_dma_thread {
-	struct ioat_dma_info *info;
-	struct dma_chan *chan;
-	enum dma_transaction_type type;
-	wait_queue_head_t done_wait;
-	struct ioat_dma_done test_done;
-	bool			done;
-	bool			pending;
-
-};
-
 struct ioat_dma_chan {
 	struct list_head node;
 	struct dma_chan *chan;
-	struct list_head threads;
 };
 
 static char test_channel[CHANNEL_NAME_LEN];
 
-/* Maximum amount of mismatched bytes in buffer to print */
-#define MAX_ERROR_COUNT 32
-
-static struct ioat_dma_thread dma_thread;
-
 static bool ioat_dma_match_channel(struct ioat_dma_params *params, struct dma_chan *chan)
 {
 	if (params->channel[0] == '\0')
@@ -118,27 +84,6 @@ static bool ioat_dma_match_device(struct ioat_dma_params *params, struct dma_dev
 	return strcmp(dev_name(device->dev), params->device) == 0;
 }
 
-static void ioat_dma_callback(void *arg)
-{
-	struct ioat_dma_done *done = arg;
-	struct ioat_dma_thread *thread =
-		container_of(done, struct ioat_dma_thread, test_done);
-	if (!thread->done) {
-		done->done = true;
-		wake_up_all(done->wait);
-	} else {
-		/*
-		 * If thread->done, it means that this callback occurred
-		 * after the parent thread has cleaned up. This can
-		 * happen in the case that driver doesn't implement
-		 * the terminate_all() functionality and a dma operation
-		 * did not occur within the timeout period
-		 */
-		WARN(1, "ioat_dma_callback: Kernel memory may be corrupted!!\n");
-	}
-}
-
-
 static void result(const char *err, unsigned int n, dma_addr_t src_addr, dma_addr_t dst_addr,
 		   unsigned int len, unsigned long data)
 {
@@ -146,105 +91,151 @@ static void result(const char *err, unsigned int n, dma_addr_t src_addr, dma_add
 		 current->comm, n, err, src_addr, dst_addr, len, data);
 }
 
+void ioat_dma_batch_init(struct ioat_dma_batch *batch)
+{
+	struct ioat_dma_info *info = &test_info;
+
+	batch->chan_mask = 0;
+	batch->next_chan = (unsigned int)atomic_inc_return(&info->chan_turn) % info->nr_channels;
+	batch->error = 0;
+	atomic_set(&batch->nr_callbacks, 0);
+	atomic64_set(&batch->nsecs_done, 0);
+}
+
+/* Record when the copies of the batch actually finished, not when they were polled */
+static void ioat_dma_batch_callback(void *param)
+{
+	struct ioat_dma_batch *batch = param;
+
+	nvmev_clock_max(&batch->nsecs_done);
+	smp_mb__before_atomic();
+	atomic_dec(&batch->nr_callbacks);
+}
+
+static struct dma_async_tx_descriptor *ioat_dma_prep(struct dma_chan *chan, dma_addr_t src_addr,
+						      dma_addr_t dst_addr, size_t size)
+{
+	/* Completion is polled through the cookies. The interrupt only runs the callback */
+	return chan->device->device_prep_dma_memcpy(chan, dst_addr, src_addr, size,
+						    DMA_PREP_INTERRUPT | DMA_CTRL_ACK);
+}
+
 // Linux Kernel의 DMA Engine API를 사용하여 인텔 I/OAT 하드웨어에 실제 복사작업을 명령
-// CPU 대신 하드웨어가 복사를 수행하도록 설정 (Polled mode, Interrupt mode 모두 지원)
-int ioat_dma_submit(dma_addr_t src_addr, dma_addr_t dst_addr, unsigned int size)
+// Only submits the descriptor. Completion is checked by ioat_dma_batch_poll()
+int ioat_dma_batch_add(struct ioat_dma_batch *batch, dma_addr_t src_addr, dma_addr_t dst_addr,
+		       size_t size)
 {
-	struct ioat_dma_thread *thread = &dma_thread;
-	struct ioat_dma_done	*done = &thread->test_done;
-	struct ioat_dma_info *info;
-	struct dma_chan *chan;
-	struct dma_device *dev;
-	struct ioat_dma_params *params;
-	dma_cookie_t cookie;
-	enum dma_status status;
-	enum dma_ctrl_flags flags = DMA_CTRL_ACK; /* Always use polled mode */
-	int ret;
-	int i;
-	struct dma_async_tx_descriptor *tx = NULL;
+	struct ioat_dma_info *info = &test_info;
+
+	pr_debug("START: 0x%llx -> 0x%llx, len: %zu\n", src_addr, dst_addr, size);
+
+	while (size) {
+		unsigned int idx = batch->next_chan;
+		struct dma_chan *chan = info->chans[idx];
+		unsigned int len = min_t(size_t, size, IOAT_DMA_CHUNK_SIZE);
+		struct dma_async_tx_descriptor *tx;
+		dma_cookie_t cookie;
+
+		tx = ioat_dma_prep(chan, src_addr, dst_addr, len);
+		if (!tx) {
+			/* Out of descriptors. Let the channel drain and retry once */
+			dma_async_issue_pending(chan);
+			if (batch->chan_mask & (1 << idx))
+				dma_sync_wait(chan, batch->last_cookie[idx]);
+			tx = ioat_dma_prep(chan, src_addr, dst_addr, len);
+		}
 
-	set_freezable();
+		if (!tx) {
+			result("prep error", 1, src_addr, dst_addr, len, -ENOMEM);
+			return batch->error = -ENOMEM;
+		}
 
-	pr_debug("START: 0x%llx -> 0x%llx, len: %d\n", src_addr, dst_addr, size);
+		tx->callback = ioat_dma_batch_callback;
+		tx->callback_param = batch;
 
-	ret = -ENOMEM;
+		/* Counted before the descriptor can complete */
+		atomic_inc(&batch->nr_callbacks);
+		cookie = dmaengine_submit(tx);
+		if (dma_submit_error(cookie)) {
+			atomic_dec(&batch->nr_callbacks);
+			result("submit error", 1, src_addr, dst_addr, len, cookie);
+			return batch->error = -EIO;
+		}
 
-	smp_rmb();
-	info = thread->info;
-	params = &info->params;
-	chan = thread->chan;
-	dev = chan->device;
+		batch->last_cookie[idx] = cookie;
+		batch->chan_mask |= 1 << idx;
+		batch->next_chan = (idx + 1) % info->nr_channels;
 
-	if (!params->polled) {
-		flags = DMA_CTRL_ACK | DMA_PREP_INTERRUPT;
+		src_addr += len;
+		dst_addr += len;
+		size -= len;
 	}
 
-	/* thread->type is always DMA_MEMCPY */
-	tx = dev->device_prep_dma_memcpy(chan, dst_addr, src_addr, size, flags);
+	return 0;
+}
 
-	if (!tx) {
-		result("prep error", 1, src_addr, dst_addr, size, ret);
-		msleep(100);
-		goto out;
-	}
+void ioat_dma_batch_issue(struct ioat_dma_batch *batch)
+{
+	struct ioat_dma_info *info = &test_info;
+	unsigned int i;
 
-	done->done = false;
-	if (!params->polled) {
-		tx->callback = ioat_dma_callback;
-		tx->callback_param = done;
+	for (i = 0; i < info->nr_channels; i++) {
+		if (batch->chan_mask & (1 << i))
+			dma_async_issue_pending(info->chans[i]);
 	}
-	cookie = tx->tx_submit(tx);
+}
 
-	if (dma_submit_error(cookie)) {
-		result("submit error", 1, src_addr, dst_addr, size, ret);
-		msleep(100);
-		goto out;
-	}
+/*
+ * Returns -EINPROGRESS while any descriptor of @batch is in flight or its
+ * callback has not run yet, so that @nsecs_done is final and the batch can be
+ * reused. Once all are done, returns 0 or the first error that occurred.
+ */
+int ioat_dma_batch_poll(struct ioat_dma_batch *batch)
+{
+	struct ioat_dma_info *info = &test_info;
+	unsigned int i;
 
-	if (params->polled) {
-		status = dma_sync_wait(chan, cookie);
-		dmaengine_terminate_sync(chan);
-		if (status == DMA_COMPLETE)
-			done->done = true;
-	} else {
-		dma_async_issue_pending(chan);
+	for (i = 0; i < info->nr_channels; i++) {
+		enum dma_status status;
 
-		wait_event_freezable_timeout(thread->done_wait,
-				done->done,
-				msecs_to_jiffies(params->timeout));
+		if (!(batch->chan_mask & (1 << i)))
+			continue;
 
-		status = dma_async_is_tx_complete(chan, cookie, NULL, NULL);
-	}
+		/* Channels complete in order, the last cookie covers the rest */
+		status = dma_async_is_tx_complete(info->chans[i], batch->last_cookie[i], NULL, NULL);
+		if (status == DMA_IN_PROGRESS || status == DMA_PAUSED)
+			return -EINPROGRESS;
 
-	if (!done->done) {
-		result("DMA timeout error", 1, src_addr, dst_addr, size, ret);
-		goto out;
-	} else if (status != DMA_COMPLETE &&
-			!(dma_has_cap(DMA_COMPLETION_NO_ORDER,
-					dev->cap_mask) &&
-				status == DMA_OUT_OF_ORDER)) {
-		result(status == DMA_ERROR ? "completion error status" : "completion busy status",
-		       1, src_addr, dst_addr, size, ret);
-		goto out;
+		if (status == DMA_ERROR) {
+			result("completion error status", 1, 0, 0, 0, batch->last_cookie[i]);
+			if (!batch->error)
+				batch->error = -EIO;
+		}
+		batch->chan_mask &= ~(1 << i);
 	}
 
-	ret = 0;
+	/* Cookies complete right before the callbacks are invoked */
+	if (atomic_read_acquire(&batch->nr_callbacks) > 0)
+		return -EINPROGRESS;
 
-out:
-	pr_debug("DONE: 0x%llx -> 0x%llx, len: %d\n", src_addr, dst_addr, size);
+	pr_debug("DONE: %d\n", batch->error);
 
-	/* terminate all transfers on specified channels */
-	if (ret)
-		dmaengine_terminate_sync(chan);
-
-	return ret;
+	return batch->error;
 }
 
 static int ioat_dma_add_channel(struct ioat_dma_info *info, struct dma_chan *chan)
 {
 	struct ioat_dma_chan *dtc;
 	struct dma_device *dma_dev = chan->device;
-	unsigned int thread_count = 0;
+
+	if (info->nr_channels >= IOAT_DMA_MAX_CHANNELS)
+		return -ENOSPC;
+
+	/* Batches are tracked by the last cookie of each channel */
+	if (dma_has_cap(DMA_COMPLETION_NO_ORDER, dma_dev->cap_mask)) {
+		pr_warn("%s completes out of order, skipped\n", dma_chan_name(chan));
+		return -EINVAL;
+	}
 
 	dtc = kmalloc(sizeof(struct ioat_dma_chan), GFP_KERNEL);
 	if (!dtc) {
@@ -253,26 +244,11 @@ static int ioat_dma_add_channel(struct ioat_dma_info *info, struct dma_chan *cha
 	}
 
 	dtc->chan = chan;
-	INIT_LIST_HEAD(&dtc->threads);
-
-	if (dma_has_cap(DMA_COMPLETION_NO_ORDER, dma_dev->cap_mask) && info->params.polled) {
-		info->params.polled = false;
-		pr_warn("DMA_COMPLETION_NO_ORDER, polled disabled\n");
-	}
-
-	if (dma_has_cap(DMA_MEMCPY, dma_dev->cap_mask)) {
-		pr_info("ioat_dma_add_threads\n");
-		dma_thread.info = info;
-		dma_thread.chan = dtc->chan;
-		dma_thread.type = DMA_MEMCPY;
-		dma_thread.test_done.wait = &dma_thread.done_wait;
-		init_waitqueue_head(&dma_thread.done_wait);
-	}
 
-	pr_info("Added %u threads using %s\n", thread_count, dma_chan_name(chan));
+	pr_info("Added %s\n", dma_chan_name(chan));
 
 	list_add_tail(&dtc->node, &info->channels);
-	info->nr_channels++;
+	info->chans[info->nr_channels++] = chan;
 
 	return 0;
 }
@@ -310,13 +286,9 @@ static void add_threaded_dma(struct ioat_dma_info *info)
 	struct ioat_dma_params *params = &info->params;
 
 	/* Copy test parameters */
-	params->buf_size = test_buf_size;
 	strscpy(params->channel, strim(test_channel), sizeof(params->channel));
 	strscpy(params->device, strim(test_device), sizeof(params->device));
 	params->max_channels = max_channels;
-	params->timeout = timeout;
-	params->transfer_size = transfer_size;
-	params->polled = polled;
 
 	request_channels(info, DMA_MEMCPY);
 }
@@ -401,5 +373,6 @@ void ioat_dma_cleanup(void)
 		dma_release_channel(chan);
 	}
 
+	memset(info->chans, 0, sizeof(info->chans));
 	info->nr_channels = 0;
 }
@@ -3,9 +3,33 @@
 #ifndef _LIB_DMA_H
 #define _LIB_DMA_H
 
+#include <linux/dmaengine.h>
+
+#define IOAT_DMA_MAX_CHANNELS 8
+
+/*
+ * DMA copies of a command in flight. Descriptors are spread over the channels
+ * round-robin, and the batch is done once the last cookie submitted to each
+ * of them has completed.
+ */
+struct ioat_dma_batch {
+	dma_cookie_t last_cookie[IOAT_DMA_MAX_CHANNELS];
+	unsigned int chan_mask; /* channels with descriptors in flight */
+	unsigned int next_chan;
+	int error;
+	atomic_t nr_callbacks; /* descriptors whose completion callback is yet to run */
+	atomic64_t nsecs_done; /* nvmev_clock() when the last descriptor completed */
+};
+
 // DMA Init, Final Function
 int ioat_dma_chan_set(const char *val);
-int ioat_dma_submit(dma_addr_t src_addr, dma_addr_t dst_addr, unsigned int size);
 void ioat_dma_cleanup(void);
 
+// Asynchronous copies
+void ioat_dma_batch_init(struct ioat_dma_batch *batch);
+int ioat_dma_batch_add(struct ioat_dma_batch *batch, dma_addr_t src_addr, dma_addr_t dst_addr,
+		       size_t size);
+void ioat_dma_batch_issue(struct ioat_dma_batch *batch);
+int ioat_dma_batch_poll(struct ioat_dma_batch *batch);
+
 #endif /* _LIB_DMA_H */
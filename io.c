@@ -4,7 +4,12 @@
 #include <linux/kthread.h>
 #include <linux/ktime.h>
 #include <linux/highmem.h>
+#include <linux/mm.h>
+#include <linux/hrtimer.h>
 #include <linux/sched/clock.h>
+#include <linux/sched/task.h>
+#include <linux/seq_file.h>
+#include <linux/vmalloc.h>
 
 #include "nvmev.h"
 #include "dma.h"
@@ -22,18 +27,37 @@ struct buffer;
 
 extern bool io_using_dma;
 
+static inline unsigned int __get_dispatcher(int sqid)
+{
+	return (sqid - 1) % nvmev_vdev->config.nr_dispatchers;
+}
+
 static inline unsigned int __get_io_worker(int sqid)
 {
 #ifdef CONFIG_NVMEV_IO_WORKER_BY_SQ
-	return (sqid - 1) % nvmev_vdev->config.nr_io_workers;
+	/*
+	 * SQs are sharded over the dispatchers by __get_dispatcher(), and each
+	 * dispatcher feeds only the workers whose id leaves the same remainder,
+	 * so that every worker has a single producer.
+	 */
+	unsigned int nr_dispatchers = nvmev_vdev->config.nr_dispatchers;
+	unsigned int disp = __get_dispatcher(sqid);
+	/* The pool may be resized meanwhile. Stick to one size */
+	unsigned int nr_workers = (READ_ONCE(nvmev_vdev->config.nr_io_workers) - disp +
+				   nr_dispatchers - 1) / nr_dispatchers;
+
+	return disp + ((sqid - 1) / nr_dispatchers % nr_workers) * nr_dispatchers;
 #else
-	return nvmev_vdev->io_worker_turn;
+	unsigned int turn = nvmev_vdev->dispatchers[0].io_worker_turn;
+
+	/* The pool may have shrunk since the turn was advanced */
+	return turn < READ_ONCE(nvmev_vdev->config.nr_io_workers) ? turn : 0;
 #endif
 }
 
 static inline unsigned long long __get_wallclock(void)
 {
-	return cpu_clock(nvmev_vdev->config.cpu_nr_dispatcher);
+	return nvmev_clock();
 }
 
 static inline size_t __cmd_io_offset(struct nvme_rw_command *cmd)
@@ -46,53 +70,108 @@ static inline size_t __cmd_io_size(struct nvme_rw_command *cmd)
 	return (cmd->length + 1) << LBA_BITS;
 }
 
-static unsigned int __do_perform_io(int sqid, int sq_entry)
+/*
+ * Map the host memory [@paddr, @paddr + @len), which is physically contiguous.
+ * RAM is reached through the direct map and anything else is memremap()ed.
+ * Without a direct map (highmem), the range must not cross a page.
+ */
+static void *__map_host_mem(u64 paddr, size_t len, bool *is_memremap)
 {
-	// 1. 초기 설정: Submission Queue와 해당 I/O 명령어 가져옴
-	struct nvmev_submission_queue *sq = nvmev_vdev->sqes[sqid];
-	struct nvme_rw_command *cmd = &sq_entry(sq_entry).rw;
-	size_t offset;  // 스토리지 내 저장 위치(오프셋)
-	size_t length, remaining;  // 총 길이 및 남은 데이터 양
-	int prp_offs = 0;  // 현재 몇 번째 PRP를 처리 중인지 카운트. PRP(Physical Region Page): 큰 데이터를 나누어 저장할 때의 주소 목록
+	if (pfn_valid(PRP_PFN(paddr)) && pfn_valid(PRP_PFN(paddr + len - 1))) {
+		*is_memremap = false;
+#ifdef CONFIG_HIGHMEM
+		return kmap_atomic_pfn(PRP_PFN(paddr)) + (paddr & PAGE_OFFSET_MASK);
+#else
+		return phys_to_virt(paddr);
+#endif
+	}
+
+	*is_memremap = true;
+	return memremap(paddr, len, MEMREMAP_WT);
+}
+
+static void __unmap_host_mem(void *vaddr, bool is_memremap)
+{
+	if (is_memremap)
+		memunmap(vaddr);
+#ifdef CONFIG_HIGHMEM
+	else
+		kunmap_atomic((void *)((unsigned long)vaddr & PAGE_MASK));
+#endif
+}
+
+/*
+ * Physically contiguous host memory accumulated while walking the data
+ * pointer. @xfer_offs is the offset of the run within the whole transfer.
+ */
+struct data_run {
+	u64 paddr;
+	size_t len;
+	size_t xfer_offs;
+	nvmev_data_seg_fn fn;
+	void *arg;
+};
+
+static void __flush_data_run(struct data_run *run)
+{
+	if (run->len == 0)
+		return;
+
+	run->fn(run->paddr, run->len, run->xfer_offs, run->arg);
+	run->xfer_offs += run->len;
+	run->len = 0;
+}
+
+static void __add_data_run(struct data_run *run, u64 paddr, size_t len)
+{
+#ifdef CONFIG_HIGHMEM
+	/* No direct map. Hand out a page at a time */
+	while (len) {
+		size_t io_size = min_t(size_t, len, PAGE_SIZE - (paddr & PAGE_OFFSET_MASK));
+
+		run->paddr = paddr;
+		run->len = io_size;
+		__flush_data_run(run);
+
+		paddr += io_size;
+		len -= io_size;
+	}
+#else
+	if (run->len && paddr == run->paddr + run->len) {
+		run->len += len;
+		return;
+	}
+
+	__flush_data_run(run);
+	run->paddr = paddr;
+	run->len = len;
+#endif
+}
+
+static unsigned int __walk_prp(u64 prp1, u64 prp2, struct data_run *run, size_t length)
+{
+	size_t remaining = length;  // 남은 데이터 양
+	int prp_offs = 0;  // 현재 몇 번째 PRP를 처리 중인지 카운트
 	int prp2_offs = 0;  // PRP List 내부의 인덱스
 	u64 paddr;  // 현재 처리할 호스트의 물리 주소
-	u64 *paddr_list = NULL;  // PRP List가 저장된 페이지의 포인터. 호스트 물리주소 리스트(PRP list)가 담겨 있는 페이지를 CPU가 읽을 수 있도록 매핑한 가상주소(포인터)
-	size_t nsid = cmd->nsid - 1; // 0-based   // 네임스페이스 ID
+	u64 *paddr_list = NULL;  // PRP List가 저장된 페이지를 매핑한 가상주소
 	bool is_paddr_memremap = false;
 
-	// 명령어로부터 '스토리지' 오프셋과 전체 전송 크기를 계산
-	offset = __cmd_io_offset(cmd);  // 가상 SSD 스토리지 내부의 절대 위치
-	length = __cmd_io_size(cmd);
-	remaining = length;
-
-	// 2. 루프: 남은 데이터가 없을 때까지 페이지 단위로 처리
+	// PRP 항목을 하나씩 따라가며 물리적으로 연속된 구간(run)끼리 묶음
 	while (remaining) {
 		size_t io_size;
-		void *vaddr;  // 호스트 물리 주소를 커널에서 접근하기 위한 가상 주소
 		size_t mem_offs = 0;  // 페이지 내 시작 오프셋
-		bool is_vaddr_memremap = false;
 
 		prp_offs++;
-		// 2-1. PRP 주소 추출 규칙 적용
 		if (prp_offs == 1) {
 			// 첫 번째 조각은 무조건 PRP1에 주소가 있음
-			paddr = cmd->prp1;
+			paddr = prp1;
 		} else if (prp_offs == 2) {
 			// 두 번째 조각: 남은 데이터가 1페이지 이하이면 PRP2가 곧 주소, 초과하면 PRP list의 시작 주소임
-			paddr = cmd->prp2;
+			paddr = prp2;
 			if (remaining > PAGE_SIZE) {
-				// PRP2 주소가 유효한 시스템 메모리(RAM) 범위인지 확인
-				if (pfn_valid(paddr >> PAGE_SHIFT)) {
-					// 시스템 RAM이면 고속 매핑(kmap_atomic) 사용
-					paddr_list = kmap_atomic_pfn(PRP_PFN(paddr)) +
-						(paddr & PAGE_OFFSET_MASK);
-				} else {
-					// RAM이 아니면(ex. 예약된 영역 등) memremap으로 접근 권한 획득
-					paddr_list = memremap(paddr, PAGE_SIZE, MEMREMAP_WT);
-					paddr_list += (paddr & PAGE_OFFSET_MASK);
-					is_paddr_memremap = true;  // 나중에 해제할 때 필요
-				}
-				// PRP List의 첫 번째 항목에서 실제 데이터 주소를 가져옴
+				paddr_list = __map_host_mem(paddr, PAGE_SIZE - (paddr & PAGE_OFFSET_MASK),
+							    &is_paddr_memremap);
 				paddr = paddr_list[prp2_offs++];
 			}
 		} else {
@@ -100,261 +179,715 @@ static unsigned int __do_perform_io(int sqid, int sq_entry)
 			paddr = paddr_list[prp2_offs++];
 		}
 
-		// 2-2. 호스트 물리 주소를 커널 가상 주소로 매핑
-		// 데이터가 저장될 호스트 페이지(paddr)를 커널이 읽고 쓸 수 있게 가상 주소(vaddr)로 매핑
-		if (pfn_valid(paddr >> PAGE_SHIFT)) {
-			vaddr = kmap_atomic_pfn(PRP_PFN(paddr));
-		} else {
-			vaddr = memremap(paddr, PAGE_SIZE, MEMREMAP_WT);
-			is_vaddr_memremap = true;
-		}
-
-		// 이번 루프에서 처리할 크기 결정 (기본적으로 1페이지이나 마지막은 남은 양만큼)
+		// 이번 조각의 크기 결정 (기본적으로 1페이지이나 마지막은 남은 양만큼)
 		io_size = min_t(size_t, remaining, PAGE_SIZE);
 
-		// 만약 주소가 페이지 중간부터 시작한다면 (Alignment 이슈), 오프셋 처리 및 크기 조정
+		// 첫 번째 PRP는 페이지 중간에서 시작할 수 있고, 해당 페이지의 끝까지만 전송해야 함
 		if (paddr & PAGE_OFFSET_MASK) {
-			// 페이지 내에서 정확히 몇 바이트 지점에서 시작하는지 계산 (오프셋 추출)
 			mem_offs = paddr & PAGE_OFFSET_MASK;
-			// 이번 루프에서 복사할 크기가 현재 페이지의 경계를 넘어가는지 체크
-			// NVMe PRP 규칙상, 첫 번째 PRP를 제외한 나머지 PRP는 반드시 페이지 시작점(0)부터 시작해야 함
-			// 하지만 첫 번째 PRP는 페이지 중간에서 시작할 수 있고, 해당 페이지의 끝까지만 전송해야 함
 			if (io_size + mem_offs > PAGE_SIZE)
-				// 전송 크기를 현재 페이지의 남은 공간으로 제한
 				io_size = PAGE_SIZE - mem_offs;
 		}
 
-		/* 2-3. 실제 데이터 복사 (CPU memcpy) */
-		if (cmd->opcode == nvme_cmd_write ||
-		    cmd->opcode == nvme_cmd_zone_append) {
-			// Write: 호스트 -> 에뮬레이션된 장치 메모리
-			memcpy(nvmev_vdev->ns[nsid].mapped + offset, vaddr + mem_offs, io_size);
-		} else if (cmd->opcode == nvme_cmd_read) {
-			// Read: 에뮬레이션된 장치 메모리 -> 호스트
-			memcpy(vaddr + mem_offs, nvmev_vdev->ns[nsid].mapped + offset, io_size);
-		}
+		__add_data_run(run, paddr, io_size);
+		remaining -= io_size;
+	}
+
+	if (paddr_list)
+		__unmap_host_mem(paddr_list, is_paddr_memremap);
+
+	return NVME_SC_SUCCESS;
+}
+
+static void __read_sgl_desc(u64 paddr, struct nvme_sgl_desc *desc)
+{
+	bool is_memremap;
+	struct nvme_sgl_desc *vaddr = __map_host_mem(paddr, sizeof(*desc), &is_memremap);
+
+	*desc = *vaddr;
+	__unmap_host_mem(vaddr, is_memremap);
+}
 
-		// 2-4. 매핑 해제 (메모리 누수 방지)
-		if (vaddr != NULL && !is_vaddr_memremap) {
-			// kmap_atomic 으로 만든 가상 주소 즉시 무효화
-			kunmap_atomic(vaddr);
-			vaddr = NULL;
-		} else if (vaddr != NULL && is_vaddr_memremap) {
-			// memremap으로 매핑한 경우 memunmap 으로 해제
-			memunmap(vaddr);
-			vaddr = NULL;  // 해제 후 포인터를 초기화하여 잘못된 참조 방지
-			is_vaddr_memremap = false;
+static unsigned int __walk_sgl(u64 dptr1, u64 dptr2, struct data_run *run, size_t length)
+{
+	struct nvme_sgl_desc desc = {
+		.addr = dptr1,
+		.length = lower_32_bits(dptr2),
+		.type = dptr2 >> 56,
+	};
+	u64 seg_paddr = 0; /* next descriptor in the current segment */
+	unsigned int nr_seg_descs = 0; /* descriptors left in the current segment */
+	bool in_last_seg = false;
+	size_t remaining = length;
+
+	while (true) {
+		size_t io_size = min_t(size_t, remaining, desc.length);
+
+		switch (desc.type >> 4) {
+		case NVME_SGL_FMT_DATA_DESC:
+			__add_data_run(run, desc.addr, io_size);
+			remaining -= io_size;
+			break;
+		case NVME_SGL_FMT_BIT_BUCKET_DESC:
+			__flush_data_run(run);
+			run->xfer_offs += io_size;
+			remaining -= io_size;
+			break;
+		case NVME_SGL_FMT_SEG_DESC:
+		case NVME_SGL_FMT_LAST_SEG_DESC:
+			if (in_last_seg || nr_seg_descs > 0)
+				return NVME_SC_SGL_INVALID_LAST;
+			if (desc.length < sizeof(desc) || desc.length % sizeof(desc))
+				return NVME_SC_SGL_INVALID_COUNT;
+
+			seg_paddr = desc.addr;
+			nr_seg_descs = desc.length / sizeof(desc);
+			in_last_seg = (desc.type >> 4) == NVME_SGL_FMT_LAST_SEG_DESC;
+			break;
+		default:
+			return NVME_SC_SGL_INVALID_TYPE;
 		}
 
-		remaining -= io_size;  // 실제 복사한 바이트 수(io_size)만큼 남은 작업량에서 차감
-		offset += io_size;
+		if (remaining == 0)
+			break;
+
+		if (nr_seg_descs == 0)
+			return NVME_SC_SGL_INVALID_DATA;
+
+		__read_sgl_desc(seg_paddr, &desc);
+		seg_paddr += sizeof(desc);
+		nr_seg_descs--;
+	}
+
+	return NVME_SC_SUCCESS;
+}
+
+/*
+ * Walk the data pointer of a command, either PRPs or an SGL according to the
+ * PSDT bits of @flags, and call @fn for each physically contiguous range of
+ * host memory covering the @length bytes of the transfer.
+ */
+unsigned int nvmev_walk_data_ptr(u8 flags, u64 dptr1, u64 dptr2, size_t length,
+				 nvmev_data_seg_fn fn, void *arg)
+{
+	struct data_run run = {
+		.fn = fn,
+		.arg = arg,
+	};
+	unsigned int status;
+
+	if (flags & NVME_CMD_SGL_ALL)
+		status = __walk_sgl(dptr1, dptr2, &run, length);
+	else
+		status = __walk_prp(dptr1, dptr2, &run, length);
+
+	__flush_data_run(&run);
+
+	return status;
+}
+
+struct data_copy {
+	void *buf;
+	bool to_host;
+	bool nocache; /* bypass the cache when writing to @buf */
+	size_t xfer_start, xfer_end; /* part of the transfer to copy */
+	unsigned int status;
+};
+
+static void __copy_data_seg(u64 paddr, size_t len, size_t xfer_offs, void *arg)
+{
+	struct data_copy *copy = arg;
+	size_t start = max(xfer_offs, copy->xfer_start);
+	size_t end = min(xfer_offs + len, copy->xfer_end);
+	bool is_memremap;
+	void *vaddr;
+
+	if (start >= end)
+		return;
+
+	paddr += start - xfer_offs;
+	len = end - start;
+	xfer_offs = start;
+
+	vaddr = __map_host_mem(paddr, len, &is_memremap);
+	if (!vaddr) {
+		NVMEV_ERROR("Cannot map host memory %llx+%zu\n", paddr, len);
+		copy->status = NVME_SC_DATA_XFER_ERROR;
+		return;
 	}
 
-	// 3. 사용 완료된 PRP List 페이지 해제
-	if (paddr_list) {
-		// 데이터 페이지와 마찬가지로 매핑 방식에 따라 적절한 해제 함수 호출
-		if (!is_paddr_memremap) 
-			kunmap_atomic(paddr_list);
-		else if (is_paddr_memremap) 
-			memunmap(paddr_list);
+	if (copy->to_host)
+		memcpy(vaddr, copy->buf + xfer_offs, len);
+	else if (copy->nocache)
+		memcpy_flushcache(copy->buf + xfer_offs, vaddr, len);
+	else
+		memcpy(copy->buf + xfer_offs, vaddr, len);
+
+	__unmap_host_mem(vaddr, is_memremap);
+}
+
+/*
+ * Copy @length bytes between the host data buffer of a command and @buf.
+ * Each physically contiguous range of the host buffer is copied at once.
+ */
+unsigned int nvmev_copy_data_ptr(u8 flags, u64 dptr1, u64 dptr2, void *buf, size_t length,
+				 bool to_host)
+{
+	struct data_copy copy = {
+		.buf = buf,
+		.to_host = to_host,
+		.xfer_end = length,
+		.status = NVME_SC_SUCCESS,
+	};
+	unsigned int status;
+
+	status = nvmev_walk_data_ptr(flags, dptr1, dptr2, length, __copy_data_seg, &copy);
+
+	return status != NVME_SC_SUCCESS ? status : copy.status;
+}
+
+/*
+ * Set up @copy for the whole transfer of a read or write command. Returns
+ * false if the command carries no data.
+ */
+static bool __init_data_copy(struct nvme_rw_command *cmd, struct data_copy *copy)
+{
+	size_t nsid = cmd->nsid - 1; // 0-based
+	size_t length = __cmd_io_size(cmd);
+	unsigned int nt_copy_threshold = nvmev_vdev->config.nt_copy_threshold;
+
+	*copy = (struct data_copy) {
+		.buf = nvmev_vdev->ns[nsid].mapped + __cmd_io_offset(cmd),
+		.xfer_end = length,
+		.status = NVME_SC_SUCCESS,
+	};
+
+	if (cmd->opcode == nvme_cmd_write || cmd->opcode == nvme_cmd_zone_append) {
+		// Write: 호스트 -> 에뮬레이션된 장치 메모리
+		copy->to_host = false;
+		/*
+		 * Large writes may be streamed past the cache, as the host is
+		 * unlikely to read them back soon. Whether that keeps the FTL
+		 * metadata cached is workload dependent, so it is opt-in.
+		 */
+		copy->nocache = nt_copy_threshold && length >= nt_copy_threshold;
+	} else if (cmd->opcode == nvme_cmd_read) {
+		// Read: 에뮬레이션된 장치 메모리 -> 호스트
+		copy->to_host = true;
+	} else {
+		return false;
 	}
-	paddr_list = NULL;
 
-	return length;
+	return true;
 }
 
-static u64 paddr_list[513] = {
-	0,
-}; // Not using index 0 to make max index == num_prp
-static unsigned int __do_perform_io_using_dma(int sqid, int sq_entry)
+/* Copy the data of a read or write command */
+static unsigned int __do_perform_io(int sqid, int sq_entry)
 {
 	struct nvmev_submission_queue *sq = nvmev_vdev->sqes[sqid];
 	struct nvme_rw_command *cmd = &sq_entry(sq_entry).rw;
-	size_t offset;
-	size_t length, remaining;
-	int prp_offs = 0;
-	int prp2_offs = 0;
-	int num_prps = 0;
-	u64 paddr;
-	u64 *tmp_paddr_list = NULL;
-	size_t io_size;
-	size_t mem_offs = 0;
-	bool is_memremap = false;
+	struct data_copy copy;
+	unsigned int status;
 
-	offset = __cmd_io_offset(cmd);
-	length = __cmd_io_size(cmd);
-	remaining = length;
+	if (!__init_data_copy(cmd, &copy))
+		return NVME_SC_SUCCESS;
 
-	memset(paddr_list, 0, sizeof(paddr_list));
-	/* Loop to get the PRP list */
-	while (remaining) {
-		io_size = 0;
+	status = nvmev_walk_data_ptr(cmd->flags, cmd->prp1, cmd->prp2, copy.xfer_end,
+				     __copy_data_seg, &copy);
 
-		prp_offs++;
-		if (prp_offs == 1) {
-			paddr_list[prp_offs] = cmd->prp1;
-		} else if (prp_offs == 2) {
-			paddr_list[prp_offs] = cmd->prp2;
-			if (remaining > PAGE_SIZE) {
-				if (pfn_valid(paddr_list[prp_offs] >> PAGE_SHIFT)) {
- 					tmp_paddr_list = kmap_atomic_pfn(PRP_PFN(paddr_list[prp_offs])) + 
-							(paddr_list[prp_offs] & PAGE_OFFSET_MASK);
- 				} else {
- 					tmp_paddr_list = memremap(paddr_list[prp_offs], PAGE_SIZE, MEMREMAP_WT);
- 					tmp_paddr_list += (paddr_list[prp_offs] & PAGE_OFFSET_MASK);
- 					is_memremap = true;
- 				}
-				paddr_list[prp_offs] = tmp_paddr_list[prp2_offs++];
-			}
-		} else {
-			paddr_list[prp_offs] = tmp_paddr_list[prp2_offs++];
-		}
+	/* Non-temporal stores are weakly ordered. Drain them before completing */
+	if (copy.nocache)
+		wmb();
 
-		io_size = min_t(size_t, remaining, PAGE_SIZE);
+	return status != NVME_SC_SUCCESS ? status : copy.status;
+}
 
-		if (paddr_list[prp_offs] & PAGE_OFFSET_MASK) {
-			mem_offs = paddr_list[prp_offs] & PAGE_OFFSET_MASK;
-			if (io_size + mem_offs > PAGE_SIZE)
-				io_size = PAGE_SIZE - mem_offs;
-		}
+static bool __is_data_cmd(int sqid, int sq_entry)
+{
+	struct nvmev_submission_queue *sq = nvmev_vdev->sqes[sqid];
+	u8 opcode = sq_entry(sq_entry).rw.opcode;
 
-		remaining -= io_size;
+	return opcode == nvme_cmd_read || opcode == nvme_cmd_write || opcode == nvme_cmd_zone_append;
+}
+
+/*
+ * Large copies are split into chunks of up to copy_chunk_size. The worker
+ * that owns the command walks its data pointer once, queues the chunks on the
+ * shared chunk queue, where any worker, including the owner, can pick them up,
+ * and copies the last chunk by itself. Each chunk is physically contiguous
+ * host memory, so a fragmented host buffer gives more, smaller chunks. The
+ * command is completed by its owner once @nr_copy_chunks drops to zero.
+ */
+#define COPY_CHUNK_MASK (NR_MAX_COPY_CHUNKS - 1)
+
+struct chunk_split {
+	struct nvmev_io_worker *worker;
+	unsigned int entry;
+	size_t chunk_size;
+	size_t local_offs; /* the owner copies from here on */
+	unsigned int nr_queued;
+	struct data_copy copy; /* for the parts the owner copies */
+};
+
+static bool __queue_copy_chunk(struct chunk_split *split, u64 paddr, size_t len, size_t xfer_offs)
+{
+	struct nvmev_copy_chunk_queue *q = &nvmev_vdev->copy_chunks;
+	struct nvmev_io_work *w = &split->worker->work_queue[split->entry];
+	struct nvmev_copy_chunk *chunk;
+
+	spin_lock(&q->lock);
+	if (q->tail - q->head == NR_MAX_COPY_CHUNKS) {
+		spin_unlock(&q->lock);
+		return false;
 	}
-	num_prps = prp_offs;
 
-	if (tmp_paddr_list != NULL && !is_memremap) {
- 		kunmap_atomic(tmp_paddr_list);
- 	} else if (tmp_paddr_list != NULL && is_memremap) {
- 		memunmap(tmp_paddr_list);
- 		is_memremap = false;
- 	}
+	/* Counted before any worker can take it */
+	atomic_inc(&w->nr_copy_chunks);
 
-	remaining = length;
-	prp_offs = 1;
+	chunk = &q->chunks[q->tail++ & COPY_CHUNK_MASK];
+	chunk->worker_id = split->worker->id;
+	chunk->entry = split->entry;
+	chunk->paddr = paddr;
+	chunk->xfer_offs = xfer_offs;
+	chunk->len = len;
+	spin_unlock(&q->lock);
 
-	/* Loop for data transfer */
-	while (remaining) {
-		size_t page_size;
-		mem_offs = 0;
-		io_size = 0;
-		page_size = 0;
+	return true;
+}
 
-		paddr = paddr_list[prp_offs];
-		page_size = min_t(size_t, remaining, PAGE_SIZE);
+static inline bool __has_copy_chunks(void)
+{
+	struct nvmev_copy_chunk_queue *q = &nvmev_vdev->copy_chunks;
 
-		/* For non-page aligned paddr, it will never be between continuous PRP list (Always first paddr)  */
-		if (paddr & PAGE_OFFSET_MASK) {
-			mem_offs = paddr & PAGE_OFFSET_MASK;
-			if (page_size + mem_offs > PAGE_SIZE) {
-				page_size = PAGE_SIZE - mem_offs;
-			}
-		}
+	return READ_ONCE(q->head) != READ_ONCE(q->tail);
+}
 
-		for (prp_offs++; prp_offs <= num_prps; prp_offs++) {
-			if (paddr_list[prp_offs] == paddr_list[prp_offs - 1] + PAGE_SIZE)
-				page_size += PAGE_SIZE;
-			else
-				break;
-		}
+static void __wake_up_idle_workers(struct nvmev_io_worker *worker)
+{
+	unsigned int i;
+
+	smp_mb(); /* Pairs with smp_mb() in __sleep_until_due() */
+
+	for (i = 0; i < nvmev_vdev->config.nr_io_workers; i++) {
+		struct nvmev_io_worker *other = &nvmev_vdev->io_workers[i];
+
+		if (other != worker && READ_ONCE(other->sleeping))
+			wake_up_process(other->task_struct);
+	}
+}
+
+static void __split_data_seg(u64 paddr, size_t len, size_t xfer_offs, void *arg)
+{
+	struct chunk_split *split = arg;
 
-		io_size = min_t(size_t, remaining, page_size);
+	while (len) {
+		size_t io_size = min(len, split->chunk_size);
 
-		if (cmd->opcode == nvme_cmd_write ||
-		    cmd->opcode == nvme_cmd_zone_append) {
-			ioat_dma_submit(paddr, nvmev_vdev->config.storage_start + offset, io_size);
-		} else if (cmd->opcode == nvme_cmd_read) {
-			ioat_dma_submit(nvmev_vdev->config.storage_start + offset, paddr, io_size);
+		/* What does not fit in the chunk queue is copied right away */
+		if (xfer_offs + io_size > split->local_offs ||
+		    !__queue_copy_chunk(split, paddr, io_size, xfer_offs)) {
+			__copy_data_seg(paddr, io_size, xfer_offs, &split->copy);
+		} else if (split->nr_queued++ == 0) {
+			__wake_up_idle_workers(split->worker);
 		}
 
-		remaining -= io_size;
-		offset += io_size;
+		paddr += io_size;
+		xfer_offs += io_size;
+		len -= io_size;
 	}
+}
+
+static unsigned int __do_perform_io_in_chunks(struct nvmev_io_worker *worker, unsigned int entry)
+{
+	struct nvmev_io_work *w = &worker->work_queue[entry];
+	struct nvmev_submission_queue *sq = nvmev_vdev->sqes[w->sqid];
+	struct nvme_rw_command *cmd = &sq_entry(w->sq_entry).rw;
+	size_t length = __cmd_io_size(cmd);
+	struct chunk_split split = {
+		.worker = worker,
+		.entry = entry,
+		.chunk_size = nvmev_vdev->config.copy_chunk_size,
+	};
+	unsigned int status;
+
+	if (split.chunk_size == 0 || length <= split.chunk_size ||
+	    nvmev_vdev->config.nr_io_workers == 1 || !__init_data_copy(cmd, &split.copy))
+		return __do_perform_io(w->sqid, w->sq_entry);
+
+	split.local_offs = length - split.chunk_size;
+	atomic_set(&w->nr_copy_chunks, 0);
+
+	status = nvmev_walk_data_ptr(cmd->flags, cmd->prp1, cmd->prp2, length, __split_data_seg,
+				     &split);
 
-	return length;
+	if (split.copy.nocache)
+		wmb();
+
+	return status != NVME_SC_SUCCESS ? status : split.copy.status;
 }
 
-static void __insert_req_sorted(unsigned int entry, struct nvmev_io_worker *worker,
-				unsigned long nsecs_target)
+/* Copy a chunk queued by any worker. Returns false if there is none */
+static bool __copy_queued_chunk(struct nvmev_io_worker *worker)
 {
-	/**
-	 * Requests are placed in @work_queue sorted by their target time.
-	 * @work_queue is statically allocated and the ordered list is
-	 * implemented by chaining the indexes of entries with @prev and @next.
-	 * This implementation is nasty but we do this way over dynamically
-	 * allocated linked list to minimize the influence of dynamic memory allocation.
-	 * Also, this O(n) implementation can be improved to O(logn) scheme with
-	 * e.g., red-black tree but....
+	struct nvmev_copy_chunk_queue *q = &nvmev_vdev->copy_chunks;
+	struct nvmev_submission_queue *sq;
+	struct nvmev_copy_chunk chunk;
+	struct nvmev_io_work *w;
+	struct data_copy copy;
+
+	if (!__has_copy_chunks())
+		return false;
+
+	spin_lock(&q->lock);
+	if (q->head == q->tail) {
+		spin_unlock(&q->lock);
+		return false;
+	}
+	chunk = q->chunks[q->head++ & COPY_CHUNK_MASK];
+	spin_unlock(&q->lock);
+
+	/*
+	 * The owner does not complete the command before all of its chunks are
+	 * copied, so the work entry and the SQ entry stay intact meanwhile.
 	 */
-	if (worker->io_seq == -1) {
-		worker->io_seq = entry;
-		worker->io_seq_end = entry;
+	w = &nvmev_vdev->io_workers[chunk.worker_id].work_queue[chunk.entry];
+	sq = nvmev_vdev->sqes[w->sqid];
+	__init_data_copy(&sq_entry(w->sq_entry).rw, &copy);
+	__copy_data_seg(chunk.paddr, chunk.len, chunk.xfer_offs, &copy);
+
+	if (copy.nocache)
+		wmb();
+
+	if (copy.status != NVME_SC_SUCCESS)
+		WRITE_ONCE(w->status, copy.status);
+	nvmev_clock_max(&w->nsecs_copy_end);
+
+	smp_mb__before_atomic(); /* Make the copy visible before the count drops */
+	atomic_dec(&w->nr_copy_chunks);
+
+	return true;
+}
+
+struct dma_copy {
+	struct ioat_dma_batch *batch;
+	u64 storage_paddr;
+	bool to_host;
+};
+
+static void __dma_data_seg(u64 paddr, size_t len, size_t xfer_offs, void *arg)
+{
+	struct dma_copy *copy = arg;
+
+	if (copy->batch->error)
+		return;
+
+	if (copy->to_host)
+		ioat_dma_batch_add(copy->batch, copy->storage_paddr + xfer_offs, paddr, len);
+	else
+		ioat_dma_batch_add(copy->batch, paddr, copy->storage_paddr + xfer_offs, len);
+}
+
+/*
+ * Submit the copies of a command to the DMA engine without waiting for them.
+ * The worker polls @batch before completing the command.
+ */
+static unsigned int __do_perform_io_using_dma(int sqid, int sq_entry, struct ioat_dma_batch *batch)
+{
+	struct nvmev_submission_queue *sq = nvmev_vdev->sqes[sqid];
+	struct nvme_rw_command *cmd = &sq_entry(sq_entry).rw;
+	struct dma_copy copy = {
+		.batch = batch,
+		.storage_paddr = nvmev_vdev->config.storage_start + __cmd_io_offset(cmd),
+	};
+	unsigned int status;
+
+	ioat_dma_batch_init(batch);
+
+	if (cmd->opcode == nvme_cmd_write || cmd->opcode == nvme_cmd_zone_append) {
+		copy.to_host = false;
+	} else if (cmd->opcode == nvme_cmd_read) {
+		copy.to_host = true;
 	} else {
-		unsigned int curr = worker->io_seq_end;
+		return NVME_SC_SUCCESS;
+	}
 
-		while (curr != -1) {
-			if (worker->work_queue[curr].nsecs_target <= worker->latest_nsecs)
-				break;
+	status = nvmev_walk_data_ptr(cmd->flags, cmd->prp1, cmd->prp2, __cmd_io_size(cmd),
+				     __dma_data_seg, &copy);
 
-			if (worker->work_queue[curr].nsecs_target <= nsecs_target)
-				break;
+	ioat_dma_batch_issue(batch);
 
-			curr = worker->work_queue[curr].prev;
-		}
+	return status;
+}
+
+/*
+ * The rings are sized to io_queue_depth, the number of work_queue entries of
+ * a worker, so that they never overflow and the producer does not need to
+ * look at the consumer's head.
+ */
+
+/* Number of completed entries a worker collects before returning them */
+#define NR_RECLAIM_BATCH 32
+
+static inline void __ring_put(struct nvmev_io_ring *ring, unsigned int *tail, unsigned int entry)
+{
+	ring->entries[(*tail)++ & ring->mask] = entry;
+}
+
+static inline void __ring_publish(struct nvmev_io_ring *ring, unsigned int tail)
+{
+	/* Pairs with smp_load_acquire() in __ring_avail() */
+	smp_store_release(&ring->tail, tail);
+}
 
-		if (curr == -1) { /* Head inserted */
-			worker->work_queue[worker->io_seq].prev = entry;
-			worker->work_queue[entry].next = worker->io_seq;
-			worker->io_seq = entry;
-		} else if (worker->work_queue[curr].next == -1) { /* Tail */
-			worker->work_queue[entry].prev = curr;
-			worker->io_seq_end = entry;
-			worker->work_queue[curr].next = entry;
-		} else { /* In between */
-			worker->work_queue[entry].prev = curr;
-			worker->work_queue[entry].next = worker->work_queue[curr].next;
-
-			worker->work_queue[worker->work_queue[entry].next].prev = entry;
-			worker->work_queue[curr].next = entry;
+static inline unsigned int __ring_avail(struct nvmev_io_ring *ring)
+{
+	return smp_load_acquire(&ring->tail);
+}
+
+static inline unsigned int __ring_get(struct nvmev_io_ring *ring, unsigned int *head)
+{
+	return ring->entries[(*head)++ & ring->mask];
+}
+
+static inline void __ring_consume(struct nvmev_io_ring *ring, unsigned int head)
+{
+	smp_store_release(&ring->head, head);
+}
+
+/* Whether idle workers take over copies from loaded ones, see __steal_copy() */
+static inline bool __steal_enabled(void)
+{
+#if (BASE_SSD == KV_PROTOTYPE)
+	/* KV commands are carried out by their owner */
+	return false;
+#else
+	return nvmev_vdev->config.io_worker_steal && !io_using_dma;
+#endif
+}
+
+static void __publish_req(unsigned int entry, struct nvmev_io_worker *worker)
+{
+	/**
+	 * Requests are handed over to @worker in the dispatched order through
+	 * @submit_ring. The worker alone orders them by their target time (see
+	 * __push_target()) and owns their completion state, so the dispatcher
+	 * does not touch the entry after publishing it.
+	 */
+	unsigned int tail = worker->submit_ring.tail;
+
+	__ring_put(&worker->submit_ring, &tail, entry);
+	__ring_publish(&worker->submit_ring, tail);
+
+	if (nvmev_vdev->config.io_worker_spin_ns) {
+		smp_mb(); /* Pairs with smp_mb() in __sleep_until_due() */
+		if (READ_ONCE(worker->sleeping))
+			wake_up_process(worker->task_struct);
+
+		/*
+		 * A second queued request can be stolen (see __steal_copy()). Peers
+		 * do not go to sleep while one is, so waking them once is enough.
+		 */
+		if (__steal_enabled() && tail - READ_ONCE(worker->submit_ring.head) == 2)
+			__wake_up_idle_workers(worker);
+	}
+}
+
+static inline bool __target_before(struct nvmev_io_worker *worker, unsigned int a, unsigned int b)
+{
+	return worker->work_queue[a].nsecs_target < worker->work_queue[b].nsecs_target;
+}
+
+static void __push_target(struct nvmev_io_worker *worker, unsigned int entry)
+{
+	unsigned int *heap = worker->target_heap;
+	unsigned int pos = worker->nr_targets++;
+
+	BUG_ON(pos >= nvmev_vdev->config.io_queue_depth);
+
+	while (pos > 0) {
+		unsigned int parent = (pos - 1) / 2;
+
+		if (!__target_before(worker, entry, heap[parent]))
+			break;
+
+		heap[pos] = heap[parent];
+		pos = parent;
+	}
+	heap[pos] = entry;
+}
+
+static unsigned int __pop_target(struct nvmev_io_worker *worker)
+{
+	unsigned int *heap = worker->target_heap;
+	unsigned int top = heap[0];
+	unsigned int last = heap[--worker->nr_targets];
+	unsigned int nr = worker->nr_targets;
+	unsigned int pos = 0;
+
+	while (true) {
+		unsigned int child = pos * 2 + 1;
+
+		if (child >= nr)
+			break;
+
+		if (child + 1 < nr && __target_before(worker, heap[child + 1], heap[child]))
+			child++;
+
+		if (!__target_before(worker, heap[child], last))
+			break;
+
+		heap[pos] = heap[child];
+		pos = child;
+	}
+	heap[pos] = last;
+
+	return top;
+}
+
+/*
+ * Copies of a request are claimed through @copy_state, either by its owner
+ * when it takes the request off the submit ring, or by an idle worker that
+ * steals it. The request is still completed by its owner, so the completion
+ * queues keep a single producer and in-order posting.
+ */
+static inline bool __claim_copy(struct nvmev_io_work *w, int state)
+{
+	return atomic_cmpxchg(&w->copy_state, IO_COPY_PENDING, state) == IO_COPY_PENDING;
+}
+
+#define NR_STEAL_SCAN 8
+
+/* Copy a request queued on a loaded peer. Returns false if there is none */
+static bool __steal_copy(struct nvmev_io_worker *worker)
+{
+#if (BASE_SSD == KV_PROTOTYPE)
+	/* KV commands are carried out by their owner */
+	return false;
+#else
+	unsigned int nr_io_workers = nvmev_vdev->config.nr_io_workers;
+	unsigned int i;
+
+	for (i = 1; i < nr_io_workers; i++) {
+		struct nvmev_io_worker *peer =
+			&nvmev_vdev->io_workers[(worker->id + i) % nr_io_workers];
+		struct nvmev_io_ring *ring = &peer->submit_ring;
+		unsigned int head = READ_ONCE(ring->head);
+		unsigned int tail = __ring_avail(ring);
+		unsigned int nr_scan = min_t(unsigned int, tail - head, NR_STEAL_SCAN);
+
+		/*
+		 * Take the newest ones. The oldest is left to the peer, which is
+		 * likely copying it right now.
+		 */
+		for (; nr_scan > 1; nr_scan--) {
+			unsigned int entry = ring->entries[--tail & ring->mask];
+			struct nvmev_io_work *w = &peer->work_queue[entry];
+			unsigned int status = NVME_SC_SUCCESS;
+
+			if (!__claim_copy(w, IO_COPY_STOLEN))
+				continue;
+
+			w->nsecs_copy_start = __get_wallclock();
+
+			if (__is_data_cmd(w->sqid, w->sq_entry))
+				status = __do_perform_io(w->sqid, w->sq_entry);
+			if (status != NVME_SC_SUCCESS)
+				w->status = status;
+			/* The owner derives is_copy_late from it */
+			w->nsecs_copy_done = __get_wallclock();
+
+			atomic_set_release(&w->copy_state, IO_COPY_STOLEN_DONE);
+			worker->stat.nr_stolen++;
+
+			NVMEV_DEBUG_VERBOSE("%s: stole %u from %s\n", worker->thread_name, entry,
+					    peer->thread_name);
+			return true;
 		}
 	}
+
+	return false;
+#endif
 }
 
-static struct nvmev_io_worker *__allocate_work_queue_entry(int sqid, unsigned int *entry)
+/* Whether a peer has a request queued that __steal_copy() could take */
+static bool __has_stealable_copy(struct nvmev_io_worker *worker)
 {
-	unsigned int io_worker_turn = __get_io_worker(sqid);
+	unsigned int i;
+
+	if (!__steal_enabled())
+		return false;
+
+	for (i = 0; i < nvmev_vdev->config.nr_io_workers; i++) {
+		struct nvmev_io_worker *peer = &nvmev_vdev->io_workers[i];
+		struct nvmev_io_ring *ring = &peer->submit_ring;
+
+		if (peer != worker && __ring_avail(ring) - READ_ONCE(ring->head) > 1)
+			return true;
+	}
+
+	return false;
+}
+
+/* The queue the requests of @sq are sharded by. All SQs of a CQ go together in CQ owner mode */
+static inline int __shard_qid(struct nvmev_submission_queue *sq)
+{
+	return nvmev_vdev->config.cq_owner ? sq->cqid : sq->qid;
+}
+
+static struct nvmev_io_worker *__allocate_work_queue_entry(int shard_qid, unsigned int *entry,
+							  bool is_internal)
+{
+	unsigned int io_worker_turn = __get_io_worker(shard_qid);
 	struct nvmev_io_worker *worker = &nvmev_vdev->io_workers[io_worker_turn];
 	unsigned int e = worker->free_seq;
-	struct nvmev_io_work *w = worker->work_queue + e;
 
-	if (w->next >= NR_MAX_PARALLEL_IO) {
-		WARN_ON_ONCE("IO queue is almost full");
+	/*
+	 * Internal operations cannot be retried, so host commands leave room for
+	 * the ones they may schedule.
+	 */
+	if (!is_internal && worker->nr_allocated - READ_ONCE(worker->nr_returned) >=
+				    nvmev_vdev->config.io_queue_depth - NR_INTERNAL_IO_RESERVED) {
+		NVMEV_DEBUG("%s: IO queue is full\n", worker->thread_name);
 		return NULL;
 	}
 
-	if (++io_worker_turn == nvmev_vdev->config.nr_io_workers)
+	if (e == -1) {
+		/* Take over all the entries the worker has reclaimed so far */
+		e = xchg(&worker->ret_seq, -1);
+		if (e == -1) {
+			/* All in flight. The caller backs off until the worker completes some */
+			NVMEV_DEBUG("%s: IO queue is full\n", worker->thread_name);
+			return NULL;
+		}
+	}
+	BUG_ON(e >= nvmev_vdev->config.io_queue_depth);
+
+	if (++io_worker_turn >= READ_ONCE(nvmev_vdev->config.nr_io_workers))
 		io_worker_turn = 0;
-	nvmev_vdev->io_worker_turn = io_worker_turn;
+	nvmev_vdev->dispatchers[0].io_worker_turn = io_worker_turn;
 
-	worker->free_seq = w->next;
-	BUG_ON(worker->free_seq >= NR_MAX_PARALLEL_IO);
+	worker->free_seq = worker->work_queue[e].next;
+	worker->nr_allocated++;
 	*entry = e;
 
 	return worker;
 }
 
-static void __enqueue_io_req(int sqid, int cqid, int sq_entry, unsigned long long nsecs_start,
-			     struct nvmev_result *ret)
+/* Give back an entry allocated for a command that was not dispatched after all */
+static void __free_work_queue_entry(struct nvmev_io_worker *worker, unsigned int entry)
 {
-	struct nvmev_submission_queue *sq = nvmev_vdev->sqes[sqid];
-	struct nvmev_io_worker *worker;
-	struct nvmev_io_work *w;
-	unsigned int entry;
-
-	worker = __allocate_work_queue_entry(sqid, &entry);
-	if (!worker)
-		return;
+	worker->work_queue[entry].next = worker->free_seq;
+	worker->free_seq = entry;
+	worker->nr_allocated--;
+}
 
-	w = worker->work_queue + entry;
+static void __enqueue_io_req(struct nvmev_io_worker *worker, unsigned int entry,
+			     struct nvmev_submission_queue *sq, int sq_entry,
+			     unsigned long long nsecs_start, struct nvmev_result *ret)
+{
+	struct nvmev_io_work *w = worker->work_queue + entry;
+	int sqid = sq->qid;
+	int cqid = sq->cqid;
 
 	NVMEV_DEBUG_VERBOSE("%s/%u[%d], sq %d cq %d, entry %d, %llu + %llu\n", worker->thread_name, entry,
 		    sq_entry(sq_entry).rw.opcode, sqid, cqid, sq_entry, nsecs_start,
@@ -365,280 +898,768 @@ static void __enqueue_io_req(int sqid, int cqid, int sq_entry, unsigned long lon
 	w->cqid = cqid;
 	w->sq_entry = sq_entry;
 	w->command_id = sq_entry(sq_entry).common.command_id;
+	w->opcode = sq_entry(sq_entry).common.opcode;
 	w->nsecs_start = nsecs_start;
-	w->nsecs_enqueue = local_clock();
+	w->nsecs_enqueue = __get_wallclock();
 	w->nsecs_target = ret->nsecs_target;
 	w->status = ret->status;
 	w->is_completed = false;
 	w->is_copied = false;
-	w->prev = -1;
+	w->is_copy_late = false;
 	w->next = -1;
 
 	w->is_internal = false;
-	mb(); /* IO worker shall see the updated w at once */
 
-	__insert_req_sorted(entry, worker, ret->nsecs_target);
+	/* Open the copy for claims last. The entry may be looked up by a stale thief */
+	atomic_set_release(&w->copy_state, IO_COPY_PENDING);
+
+	__publish_req(entry, worker);
 }
 
 void schedule_internal_operation(int sqid, unsigned long long nsecs_target,
 				 struct buffer *write_buffer, size_t buffs_to_release)
 {
+	struct nvmev_submission_queue *sq = READ_ONCE(nvmev_vdev->sqes[sqid]);
 	struct nvmev_io_worker *worker;  // 이 작업을 처리할 전용 워커 스레드
 	struct nvmev_io_work *w;  // 구체적인 작업 내용을 담을 구조체
 	unsigned int entry;  // 워커의 작업 큐 내에서의 인덱스(번호)
 
 	/* 1. 워커 할당: 해당 Submission Queue(sqid)를 담당하는 I/O 워커와 빈 슬롯을 가져옴 */
-	worker = __allocate_work_queue_entry(sqid, &entry);
-	if (!worker)
-		return;  // 빈 자리가 없으면 작업을 등록하지 못하고 종료
+	/* The SQ may be under deletion already. Any worker can release the buffer then */
+	worker = __allocate_work_queue_entry(sq ? __shard_qid(sq) : sqid, &entry, true);
+	if (!worker) {
+		/*
+		 * The reserve ran out, which the host should not be able to cause
+		 * within MDTS. Release the buffer now rather than leaking it, which
+		 * would stall the writes for good.
+		 */
+		NVMEV_ERROR("No work entry left for an internal operation of SQ %d\n", sqid);
+#if (SUPPORTED_SSD_TYPE(CONV) || SUPPORTED_SSD_TYPE(ZNS))
+		buffer_release(write_buffer, buffs_to_release);
+#endif
+		return;
+	}
 
 	/* 2. 작업 위치 지정: 할당받은 인덱스를 사용해 실제 작업(work) 객체 주소를 얻음 */
 	w = worker->work_queue + entry;
 
 	/* 3. 디버그 로그: 현재 시간 대비 작업이 완료될 목표 시간까지의 남은 지연 시간 출력 */
 	NVMEV_DEBUG_VERBOSE("%s/%u, internal sq %d, %llu + %llu\n", worker->thread_name, entry, sqid,
-		    local_clock(), nsecs_target - local_clock());
+		    __get_wallclock(), nsecs_target - __get_wallclock());
 
 	/////////////////////////////////
 	/* 4. 작업 기본 정보 설정 */
 	w->sqid = sqid;  // 어떤 큐에서 온 명령인지 기록
 	// 시작 시간과 큐에 들어간 시간을 현재 시간으로 기록
-	w->nsecs_start = w->nsecs_enqueue = local_clock();
+	w->nsecs_start = w->nsecs_enqueue = __get_wallclock();
 	w->nsecs_target = nsecs_target;  // 낸드 지연 시간이 반영된 "실제 완료될 미래 시간"
 	w->is_completed = false;  // 아직 시작 전이므로 완료 플래그는 거짓
 	w->is_copied = true;  // 데이터 복사가 이미 완료되었음을 표시
-	w->prev = -1;  // 리스트 연결용 (초기값 -1)
+	atomic_set(&w->copy_state, IO_COPY_OWNER); /* Nothing to steal */
 	w->next = -1; // 리스트 연결용 (초기값 -1)
 
-	/* 5. 내부 작업 특수 설정 (핵심) */
-	w->is_internal = true;  // 호스트 명령이 아닌 FTL 내부의 "관리용 작업"임을 표시
-	w->write_buffer = write_buffer;  // 작업 완료 시 해제해야 할 쓰기 버퍼의 주소
-	w->buffs_to_release = buffs_to_release;  // 해제할 버퍼의 크기 (데이터 전송 완료 후 빈 공간 확보용)
+	/* 5. 내부 작업 특수 설정 (핵심) */
+	w->is_internal = true;  // 호스트 명령이 아닌 FTL 내부의 "관리용 작업"임을 표시
+	w->write_buffer = write_buffer;  // 작업 완료 시 해제해야 할 쓰기 버퍼의 주소
+	w->buffs_to_release = buffs_to_release;  // 해제할 버퍼의 크기 (데이터 전송 완료 후 빈 공간 확보용)
+
+	/* 6. Hand it to the worker, which orders it by nsecs_target */
+	__publish_req(entry, worker);
+}
+
+static size_t __nvmev_proc_io(struct nvmev_submission_queue *sq, int sq_entry, size_t *io_size)
+{
+	unsigned long long nsecs_start = __get_wallclock();
+	struct nvme_command *cmd = &sq_entry(sq_entry);
+#if (BASE_SSD == KV_PROTOTYPE)
+	uint32_t nsid = 0; // Some KVSSD programs give 0 as nsid for KV IO
+#else
+	uint32_t nsid = cmd->common.nsid - 1;
+#endif
+	struct nvmev_ns *ns = &nvmev_vdev->ns[nsid];
+	struct nvmev_io_worker *worker;
+	unsigned int entry;
+
+	struct nvmev_request req = {
+		.cmd = cmd,
+		.sq_id = sq->qid,
+		.nsecs_start = nsecs_start,
+	};
+	struct nvmev_result ret = {
+		.nsecs_target = nsecs_start,
+		.status = NVME_SC_SUCCESS,
+	};
+
+#ifdef PERF_DEBUG
+	unsigned long long prev_clock = __get_wallclock();
+	unsigned long long prev_clock2 = 0;
+	unsigned long long prev_clock3 = 0;
+	static unsigned long long clock1 = 0;
+	static unsigned long long clock2 = 0;
+	static unsigned long long counter = 0;
+#endif
+
+	/*
+	 * Reserve the work entry before the FTL takes the command in. When the
+	 * worker has none left, the command stays in the SQ and is retried once
+	 * some complete, just like when the write buffer is full.
+	 */
+	worker = __allocate_work_queue_entry(__shard_qid(sq), &entry, false);
+	if (!worker)
+		return false;
+
+	if (ns->lock_io_cmd) {
+		bool processed;
+
+		spin_lock(&ns->io_cmd_lock);
+		processed = ns->proc_io_cmd(ns, &req, &ret);
+		spin_unlock(&ns->io_cmd_lock);
+
+		if (!processed) {
+			__free_work_queue_entry(worker, entry);
+			return false;
+		}
+	} else if (!ns->proc_io_cmd(ns, &req, &ret)) {
+		__free_work_queue_entry(worker, entry);
+		return false;
+	}
+	*io_size = __cmd_io_size(&sq_entry(sq_entry).rw);
+
+#ifdef PERF_DEBUG
+	prev_clock2 = __get_wallclock();
+#endif
+
+	__enqueue_io_req(worker, entry, sq, sq_entry, nsecs_start, &ret);
+
+#ifdef PERF_DEBUG
+	prev_clock3 = __get_wallclock();
+
+	clock1 += (prev_clock2 - prev_clock);
+	clock2 += (prev_clock3 - prev_clock2);
+	counter++;
+
+	if (counter > 1000) {
+		NVMEV_DEBUG("LAT: %llu, ENQ: %llu\n", clock1 / counter, clock2 / counter);
+		clock1 = 0;
+		clock2 = 0;
+		counter = 0;
+	}
+#endif
+	return true;
+}
+
+int nvmev_proc_io_sq(struct nvmev_submission_queue *sq, int new_db, int old_db,
+		     unsigned int max_proc)
+{
+	int num_proc = new_db - old_db;
+	int seq;
+	int sq_entry = old_db;
+	int latest_db;
+
+	if (unlikely(num_proc < 0))
+		num_proc += sq->queue_size;
+	num_proc = min_t(unsigned int, num_proc, max_proc);
+
+	for (seq = 0; seq < num_proc; seq++) {
+		size_t io_size;
+		if (!__nvmev_proc_io(sq, sq_entry, &io_size))
+			break;
+
+		if (++sq_entry == sq->queue_size) {
+			sq_entry = 0;
+		}
+		sq->stat.nr_dispatched++;
+		sq->stat.nr_in_flight++;
+		sq->stat.total_io += io_size;
+	}
+	sq->stat.nr_dispatch++;
+	sq->stat.max_nr_in_flight = max_t(int, sq->stat.max_nr_in_flight, sq->stat.nr_in_flight);
+
+	latest_db = (old_db + seq) % sq->queue_size;
+	return latest_db;
+}
+
+void nvmev_proc_io_cq(struct nvmev_completion_queue *cq, int new_db, int old_db)
+{
+	int i;
+	for (i = old_db; i != new_db; i++) {
+		int sqid = cq_entry(i).sq_id;
+		struct nvmev_submission_queue *sq;
+
+		if (i >= cq->queue_size) {
+			i = -1;
+			continue;
+		}
+
+		/* Should check the validity here since SPDK deletes SQ immediately
+		 * before processing associated CQes */
+		sq = READ_ONCE(nvmev_vdev->sqes[sqid]);
+		if (!sq) continue;
+
+		sq->stat.nr_in_flight--;
+	}
+
+	cq->cq_tail = new_db - 1;
+	if (new_db == -1)
+		cq->cq_tail = cq->queue_size - 1;
+}
+
+static void __fill_cq_result(struct nvmev_io_work *w, unsigned long long nsecs)
+{
+	int sqid = w->sqid;
+	int cqid = w->cqid;
+	int sq_entry = w->sq_entry;
+	unsigned int command_id = w->command_id;
+	unsigned int status = w->status;
+	unsigned int result0 = w->result0;
+	unsigned int result1 = w->result1;
+
+	struct nvmev_completion_queue *cq = nvmev_vdev->cqes[cqid];
+	struct nvme_completion *cqe;
+	int cq_head;
+
+	spin_lock(&cq->entry_lock);
+	cq_head = cq->cq_head;
+	cqe = &cq_entry(cq_head);
+
+	cqe->command_id = command_id;
+	cqe->sq_id = sqid;
+	cqe->sq_head = sq_entry;
+	cqe->status = cq->phase | (status << 1);
+	cqe->result0 = result0;
+	cqe->result1 = result1;
+
+	if (++cq_head == cq->queue_size) {
+		cq_head = 0;
+		cq->phase = !cq->phase;
+	}
+
+	cq->cq_head = cq_head;
+	if (cq->nr_irq_pending++ == 0)
+		cq->nsecs_irq_pending = nsecs;
+	cq->interrupt_ready = true;
+	spin_unlock(&cq->entry_lock);
+}
+
+/*
+ * CQ owner mode. Only the owner worker writes to the CQ, so no entry_lock.
+ * The entry is written with the stale phase, which the host ignores, and
+ * goes live when __post_cq_batches() flips the phase of the whole batch.
+ */
+static void __stage_cq_result(struct nvmev_io_worker *worker, struct nvmev_io_work *w)
+{
+	struct nvmev_completion_queue *cq = nvmev_vdev->cqes[w->cqid];
+	struct nvme_completion *cqe;
+	int cq_head = cq->cq_head + cq->nr_staged;
+	int phase = cq->phase;
+
+	if (cq_head >= cq->queue_size) {
+		cq_head -= cq->queue_size;
+		phase = !phase;
+	}
+
+	cqe = &cq_entry(cq_head);
+	cqe->command_id = w->command_id;
+	cqe->sq_id = w->sqid;
+	cqe->sq_head = w->sq_entry;
+	cqe->result0 = w->result0;
+	cqe->result1 = w->result1;
+	cqe->status = (!phase) | (w->status << 1);
+
+	if (cq->nr_staged++ == 0)
+		__set_bit(w->cqid, worker->cq_staged);
+}
+
+static void __post_cq_batches(struct nvmev_io_worker *worker, unsigned long long nsecs)
+{
+	unsigned int cqid;
+
+	/* The staged entries must be visible before their phase flips */
+	smp_wmb();
+
+	for_each_set_bit(cqid, worker->cq_staged, NR_MAX_IO_QUEUE + 1) {
+		struct nvmev_completion_queue *cq = nvmev_vdev->cqes[cqid];
+		int cq_head = cq->cq_head;
+		unsigned int i;
+
+		for (i = 0; i < cq->nr_staged; i++) {
+			cq_entry(cq_head).status ^= 1;
+
+			if (++cq_head == cq->queue_size) {
+				cq_head = 0;
+				cq->phase = !cq->phase;
+			}
+		}
+		cq->cq_head = cq_head;
+
+		if (cq->nr_irq_pending == 0)
+			cq->nsecs_irq_pending = nsecs;
+		cq->nr_irq_pending += cq->nr_staged;
+		cq->nr_staged = 0;
+		cq->interrupt_ready = true;
+
+		__clear_bit(cqid, worker->cq_staged);
+	}
+}
+
+/*
+ * Return the entries reclaimed by the worker to the dispatcher in a batch.
+ * Batches are pushed onto @ret_seq and the dispatcher takes over the whole
+ * chain with xchg() when it runs out of free entries, so no ABA problem.
+ */
+static void __return_reclaimed_reqs(struct nvmev_io_worker *worker)
+{
+	unsigned int old, head;
+
+	if (worker->nr_reclaimed == 0)
+		return;
+
+	head = READ_ONCE(worker->ret_seq);
+	do {
+		old = head;
+		worker->work_queue[worker->reclaim_seq_end].next = old;
+		head = cmpxchg(&worker->ret_seq, old, worker->reclaim_seq);
+	} while (head != old);
+
+	NVMEV_DEBUG_VERBOSE("%s: returned %d\n", worker->thread_name, worker->nr_reclaimed);
+
+	/* Counted after the entries are back, so the dispatcher never overshoots */
+	smp_store_release(&worker->nr_returned, worker->nr_returned + worker->nr_reclaimed);
+
+	worker->reclaim_seq = -1;
+	worker->reclaim_seq_end = -1;
+	worker->nr_reclaimed = 0;
+}
+
+/*
+ * The owner only notices the end of a copy when it polls at the due time, so
+ * the time the copy actually finished is taken from whoever finished it.
+ */
+static void __copy_done(struct nvmev_io_worker *worker, unsigned int entry)
+{
+	struct nvmev_io_work *w = &worker->work_queue[entry];
+
+	/* Stolen copies are timed by the thief */
+	if (atomic_read(&w->copy_state) != IO_COPY_STOLEN_DONE) {
+		if (io_using_dma)
+			w->nsecs_copy_done = atomic64_read(&worker->dma_batches[entry].nsecs_done);
+		else
+			w->nsecs_copy_done = atomic64_read(&w->nsecs_copy_end);
+
+		/* Nothing was copied */
+		if (w->nsecs_copy_done == 0)
+			w->nsecs_copy_done = __get_wallclock();
+	}
+	w->is_copy_late = w->nsecs_copy_done > w->nsecs_target;
+	w->is_copied = true;
+
+	NVMEV_DEBUG_VERBOSE("%s: copied %u, %d %d %d\n", worker->thread_name, entry, w->sqid,
+			    w->cqid, w->sq_entry);
+}
+
+static void __copy_req(struct nvmev_io_worker *worker, unsigned int entry)
+{
+	struct nvmev_io_work *w = &worker->work_queue[entry];
+
+	unsigned int status = NVME_SC_SUCCESS;
+
+	w->nsecs_copy_start = __get_wallclock();
+	atomic64_set(&w->nsecs_copy_end, 0);
+
+	if (io_using_dma) {
+		/* Only submitted to the DMA engine here. Completion is polled later */
+		status = __do_perform_io_using_dma(w->sqid, w->sq_entry,
+						   &worker->dma_batches[entry]);
+	} else {
+#if (BASE_SSD == KV_PROTOTYPE)
+		struct nvmev_submission_queue *sq = nvmev_vdev->sqes[w->sqid];
+		struct nvmev_ns *ns = &nvmev_vdev->ns[0];
+
+		if (ns->identify_io_cmd(ns, sq_entry(w->sq_entry))) {
+			w->result0 = ns->perform_io_cmd(ns, &sq_entry(w->sq_entry), &(w->status));
+		} else {
+			status = __do_perform_io_in_chunks(worker, entry);
+		}
+#else
+		/* Copy with memcpy() */
+		status = __do_perform_io_in_chunks(worker, entry);
+#endif
+	}
+
+	if (status != NVME_SC_SUCCESS)
+		w->status = status;
+
+	worker->stat.nr_copied++;
+
+	/* Asynchronous copies are done when all of their parts complete */
+	if (!io_using_dma) {
+		nvmev_clock_max(&w->nsecs_copy_end);
+		if (atomic_read_acquire(&w->nr_copy_chunks) == 0)
+			__copy_done(worker, entry);
+	}
+}
+
+/*
+ * Returns true once the data of @entry is in place. DMA copies and copies
+ * taken over by other workers are polled, so the worker keeps serving other
+ * requests while they are in flight.
+ */
+static bool __is_copied(struct nvmev_io_worker *worker, unsigned int entry)
+{
+	struct nvmev_io_work *w = &worker->work_queue[entry];
+	int ret;
+
+	if (w->is_copied)
+		return true;
+
+	ret = atomic_read_acquire(&w->copy_state);
+	if (ret == IO_COPY_STOLEN) {
+		return false;
+	} else if (ret != IO_COPY_STOLEN_DONE && !io_using_dma) {
+		/* Chunks still being copied by other workers */
+		if (atomic_read_acquire(&w->nr_copy_chunks) > 0)
+			return false;
+	} else if (ret != IO_COPY_STOLEN_DONE) {
+		ret = ioat_dma_batch_poll(&worker->dma_batches[entry]);
+		if (ret == -EINPROGRESS)
+			return false;
+
+		if (ret)
+			w->status = NVME_SC_DATA_XFER_ERROR;
+	}
+
+	__copy_done(worker, entry);
+
+	return true;
+}
+
+/*
+ * Latency histograms with log-linear buckets: every power of two is split
+ * into LAT_NR_SUB buckets, so each bucket is within 1/LAT_NR_SUB of its
+ * values. Values below 2 * LAT_NR_SUB get a bucket of their own.
+ *
+ * Every worker keeps histograms of its own, which are summed up on read, so
+ * that no update is lost. A reset is carried out by each worker on itself not
+ * to race with its updates.
+ */
+static unsigned int __lat_bucket(unsigned long long nsecs)
+{
+	unsigned int shift;
+
+	if (nsecs < 2 * LAT_NR_SUB)
+		return nsecs;
+
+	shift = fls64(nsecs) - 1 - LAT_SUB_BITS;
+
+	return min_t(unsigned int, shift * LAT_NR_SUB + (nsecs >> shift), NR_LAT_BUCKETS - 1);
+}
+
+/* The largest value that falls into @bucket */
+static unsigned long long __lat_bucket_max(unsigned int bucket)
+{
+	unsigned int shift;
+
+	if (bucket < 2 * LAT_NR_SUB)
+		return bucket;
+
+	shift = bucket / LAT_NR_SUB - 1;
+
+	return (((unsigned long long)(bucket % LAT_NR_SUB + LAT_NR_SUB) + 1) << shift) - 1;
+}
 
-	/* 6. 메모리 베리어: 멀티코어 환경에서 다른 스레드(워커)가 업데이트된 w의 내용을 즉시 보도록 보장 */
-	// conv-write를 실행하는 코어와 io-worker 스레드가 떠 있는 코어가 다를 수 있기 때문
-	mb(); /* IO worker shall see the updated w at once */
+static void __lat_add(struct nvmev_lat_hist *hist, long long nsecs)
+{
+	if (nsecs < 0)
+		nsecs = 0;
+
+	hist->buckets[__lat_bucket(nsecs)]++;
+	hist->count++;
+	hist->sum += nsecs;
+	if (nsecs > hist->max)
+		hist->max = nsecs;
+}
 
-	/* 7. 작업 삽입: 목표 시간(nsecs_target)에 맞춰 정렬된 상태로 워커의 작업 목록에 집어넣음
-	  나중에 워커 스레드는 시간이 빠른 순서대로 이 작업들을 꺼내 처리 */
-	__insert_req_sorted(entry, worker, nsecs_target);
+static inline unsigned int __lat_op(u8 opcode)
+{
+	if (opcode == nvme_cmd_read)
+		return LAT_OP_READ;
+	if (opcode == nvme_cmd_write || opcode == nvme_cmd_zone_append)
+		return LAT_OP_WRITE;
+	return LAT_OP_OTHER;
 }
 
-static void __reclaim_completed_reqs(void)
+static void __record_latency(struct nvmev_io_worker *worker, struct nvmev_io_work *w,
+			     unsigned long long curr_nsecs)
 {
-	unsigned int turn;
+	struct nvmev_lat_hist *hist = worker->sq_lat[w->sqid].hist[__lat_op(w->opcode)];
 
-	for (turn = 0; turn < nvmev_vdev->config.nr_io_workers; turn++) {
-		struct nvmev_io_worker *worker;
-		struct nvmev_io_work *w;
+	__lat_add(&hist[LAT_TARGET], w->nsecs_target - w->nsecs_start);
+	__lat_add(&hist[LAT_COPY], w->nsecs_copy_done - w->nsecs_copy_start);
+	__lat_add(&hist[LAT_LATENESS], curr_nsecs - w->nsecs_target);
+}
 
-		unsigned int first_entry = -1;
-		unsigned int last_entry = -1;
-		unsigned int curr;
-		int nr_reclaimed = 0;
+/* The smallest bucket bound that covers @permille of the samples */
+static unsigned long long __lat_percentile(struct nvmev_lat_hist *hist, unsigned int permille)
+{
+	unsigned long long rank = div64_u64(hist->count * permille + 999, 1000);
+	unsigned long long seen = 0;
+	unsigned int i;
 
-		worker = &nvmev_vdev->io_workers[turn];
+	for (i = 0; i < NR_LAT_BUCKETS; i++) {
+		seen += hist->buckets[i];
+		if (seen >= rank)
+			return min(__lat_bucket_max(i), hist->max);
+	}
 
-		first_entry = worker->io_seq;
-		curr = first_entry;
+	return hist->max;
+}
 
-		while (curr != -1) {
-			w = &worker->work_queue[curr];
-			if (w->is_completed == true && w->is_copied == true &&
-			    w->nsecs_target <= worker->latest_nsecs) {
-				last_entry = curr;
-				curr = w->next;
-				nr_reclaimed++;
-			} else {
-				break;
-			}
-		}
+/* Sum up the histograms of all workers. Those with a reset pending count as empty */
+static void __sum_latency(struct nvmev_lat_hist *sum, unsigned int sqid, unsigned int op,
+			  unsigned int metric)
+{
+	unsigned int i, bucket;
 
-		if (last_entry != -1) {
-			w = &worker->work_queue[last_entry];
-			worker->io_seq = w->next;
-			if (w->next != -1) {
-				worker->work_queue[w->next].prev = -1;
-			}
-			w->next = -1;
+	memset(sum, 0, sizeof(*sum));
 
-			w = &worker->work_queue[first_entry];
-			w->prev = worker->free_seq_end;
+	for (i = 0; i < ARRAY_SIZE(nvmev_vdev->config.cpu_nr_io_workers); i++) {
+		struct nvmev_io_worker *worker = &nvmev_vdev->io_workers[i];
+		struct nvmev_lat_hist *hist;
 
-			w = &worker->work_queue[worker->free_seq_end];
-			w->next = first_entry;
+		if (!worker->sq_lat || smp_load_acquire(&worker->lat_reset))
+			continue;
 
-			worker->free_seq_end = last_entry;
-			NVMEV_DEBUG_VERBOSE("%s: %u -- %u, %d\n", __func__,
-					first_entry, last_entry, nr_reclaimed);
-		}
+		hist = &worker->sq_lat[sqid].hist[op][metric];
+		if (hist->count == 0)
+			continue;
+
+		for (bucket = 0; bucket < NR_LAT_BUCKETS; bucket++)
+			sum->buckets[bucket] += hist->buckets[bucket];
+		sum->count += hist->count;
+		sum->sum += hist->sum;
+		sum->max = max(sum->max, hist->max);
 	}
 }
 
-static size_t __nvmev_proc_io(int sqid, int sq_entry, size_t *io_size)
+/* The caller serializes this with nvmev_reset_latency() and resizing the worker pool */
+void nvmev_show_latency(struct seq_file *m)
 {
-	struct nvmev_submission_queue *sq = nvmev_vdev->sqes[sqid];
-	unsigned long long nsecs_start = __get_wallclock();
-	struct nvme_command *cmd = &sq_entry(sq_entry);
-#if (BASE_SSD == KV_PROTOTYPE)
-	uint32_t nsid = 0; // Some KVSSD programs give 0 as nsid for KV IO
-#else
-	uint32_t nsid = cmd->common.nsid - 1;
-#endif
-	struct nvmev_ns *ns = &nvmev_vdev->ns[nsid];
+	static const char * const op_names[NR_LAT_OPS] = { "read", "write", "other" };
+	static const char * const metric_names[NR_LAT_METRICS] = { "target", "copy", "late" };
+	struct nvmev_lat_hist *hist;
+	unsigned int sqid, op, metric;
 
-	struct nvmev_request req = {
-		.cmd = cmd,
-		.sq_id = sqid,
-		.nsecs_start = nsecs_start,
-	};
-	struct nvmev_result ret = {
-		.nsecs_target = nsecs_start,
-		.status = NVME_SC_SUCCESS,
-	};
+	if (!nvmev_vdev->io_workers)
+		return;
 
-#ifdef PERF_DEBUG
-	unsigned long long prev_clock = local_clock();
-	unsigned long long prev_clock2 = 0;
-	unsigned long long prev_clock3 = 0;
-	unsigned long long prev_clock4 = 0;
-	static unsigned long long clock1 = 0;
-	static unsigned long long clock2 = 0;
-	static unsigned long long clock3 = 0;
-	static unsigned long long counter = 0;
-#endif
+	hist = kmalloc(sizeof(*hist), GFP_KERNEL);
+	if (!hist)
+		return;
 
-	if (!ns->proc_io_cmd(ns, &req, &ret))
-		return false;
-	*io_size = __cmd_io_size(&sq_entry(sq_entry).rw);
+	seq_printf(m, "# sq op metric count mean p50 p99 p99.9 max (ns)\n");
+	for (sqid = 1; sqid <= NR_MAX_IO_QUEUE; sqid++) {
+		for (op = 0; op < NR_LAT_OPS; op++) {
+			for (metric = 0; metric < NR_LAT_METRICS; metric++) {
+				__sum_latency(hist, sqid, op, metric);
+				if (hist->count == 0)
+					continue;
+
+				seq_printf(m, "%2u %5s %6s %llu %llu %llu %llu %llu %llu\n", sqid,
+					   op_names[op], metric_names[metric], hist->count,
+					   div64_u64(hist->sum, hist->count),
+					   __lat_percentile(hist, 500), __lat_percentile(hist, 990),
+					   __lat_percentile(hist, 999), hist->max);
+			}
+		}
+	}
 
-#ifdef PERF_DEBUG
-	prev_clock2 = local_clock();
-#endif
+	kfree(hist);
+}
 
-	__enqueue_io_req(sqid, sq->cqid, sq_entry, nsecs_start, &ret);
+static void __clear_latency(struct nvmev_io_worker *worker)
+{
+	memset(worker->sq_lat, 0, sizeof(struct nvmev_sq_lat) * (NR_MAX_IO_QUEUE + 1));
+	smp_store_release(&worker->lat_reset, false);
+}
 
-#ifdef PERF_DEBUG
-	prev_clock3 = local_clock();
-#endif
+/*
+ * Running workers clear their histograms by themselves on their next pass.
+ * The caller serializes this with resizing the worker pool.
+ */
+void nvmev_reset_latency(void)
+{
+	unsigned int nr_slots =
+		nvmev_vdev->io_workers ? ARRAY_SIZE(nvmev_vdev->config.cpu_nr_io_workers) : 0;
+	unsigned int i;
 
-	__reclaim_completed_reqs();
+	for (i = 0; i < nr_slots; i++) {
+		struct nvmev_io_worker *worker = &nvmev_vdev->io_workers[i];
 
-#ifdef PERF_DEBUG
-	prev_clock4 = local_clock();
+		if (!worker->sq_lat)
+			continue;
 
-	clock1 += (prev_clock2 - prev_clock);
-	clock2 += (prev_clock3 - prev_clock2);
-	clock3 += (prev_clock4 - prev_clock3);
-	counter++;
+		if (i < nvmev_vdev->config.nr_io_workers)
+			WRITE_ONCE(worker->lat_reset, true);
+		else
+			__clear_latency(worker);
+	}
+}
 
-	if (counter > 1000) {
-		NVMEV_DEBUG("LAT: %llu, ENQ: %llu, CLN: %llu\n", clock1 / counter, clock2 / counter,
-			    clock3 / counter);
-		clock1 = 0;
-		clock2 = 0;
-		clock3 = 0;
-		counter = 0;
+/* How well the worker keeps up with the target times of the model */
+static void __account_lateness(struct nvmev_io_worker *worker, struct nvmev_io_work *w,
+			       unsigned long long curr_nsecs)
+{
+	unsigned long long late_nsecs = curr_nsecs - w->nsecs_target;
+
+	/* Cleared here rather than by the reset not to race with the update below */
+	if (unlikely(READ_ONCE(worker->stat_reset_max))) {
+		worker->stat.max_late_nsecs = 0;
+		smp_store_release(&worker->stat_reset_max, false);
 	}
-#endif
-	return true;
+
+	worker->stat.late_nsecs += late_nsecs;
+	if (late_nsecs > worker->stat.max_late_nsecs)
+		worker->stat.max_late_nsecs = late_nsecs;
+	if (late_nsecs > IO_WORKER_LATE_NSECS)
+		worker->stat.nr_late++;
+	if (w->is_copy_late)
+		worker->stat.nr_copy_late++;
 }
 
-int nvmev_proc_io_sq(int sqid, int new_db, int old_db)
+static unsigned int __complete_due_reqs(struct nvmev_io_worker *worker)
 {
-	struct nvmev_submission_queue *sq = nvmev_vdev->sqes[sqid];
-	int num_proc = new_db - old_db;
-	int seq;
-	int sq_entry = old_db;
-	int latest_db;
+	unsigned long long curr_nsecs = __get_wallclock();
+	unsigned int nr_completed = 0;
 
-	if (unlikely(!sq))
-		return old_db;
-	if (unlikely(num_proc < 0))
-		num_proc += sq->queue_size;
+	worker->latest_nsecs = curr_nsecs;
 
-	for (seq = 0; seq < num_proc; seq++) {
-		size_t io_size;
-		if (!__nvmev_proc_io(sqid, sq_entry, &io_size))
+	/* Only the requests at the top of the heap can be due */
+	while (worker->nr_targets > 0) {
+		unsigned int curr = worker->target_heap[0];
+		struct nvmev_io_work *w = &worker->work_queue[curr];
+
+		if (w->nsecs_target > curr_nsecs)
 			break;
 
-		if (++sq_entry == sq->queue_size) {
-			sq_entry = 0;
+		if (!__is_copied(worker, curr))
+			break;
+
+		__pop_target(worker);
+
+		if (w->is_internal) {
+			// 내부 작업(GC 등) 완료 시 버퍼 자원 해제
+#if (SUPPORTED_SSD_TYPE(CONV) || SUPPORTED_SSD_TYPE(ZNS))
+			buffer_release((struct buffer *)w->write_buffer, w->buffs_to_release);
+#endif
+		} else {
+			// 일반 호스트 I/O라면 완료 큐(CQ)에 결과 기록 (인터럽트 준비)
+			if (nvmev_vdev->config.cq_owner)
+				__stage_cq_result(worker, w);
+			else
+				__fill_cq_result(w, curr_nsecs);
+			__record_latency(worker, w, curr_nsecs);
+			__account_lateness(worker, w, curr_nsecs);
 		}
-		sq->stat.nr_dispatched++;
-		sq->stat.nr_in_flight++;
-		sq->stat.total_io += io_size;
+
+		NVMEV_DEBUG_VERBOSE("%s: completed %u, %d %d %d\n", worker->thread_name, curr,
+				    w->sqid, w->cqid, w->sq_entry);
+
+#ifdef PERF_DEBUG
+		w->nsecs_cq_filled = __get_wallclock();
+		trace_printk("%llu %llu %llu %llu %llu %llu\n", w->nsecs_start,
+			     w->nsecs_enqueue - w->nsecs_start,
+			     w->nsecs_copy_start - w->nsecs_start,
+			     w->nsecs_copy_done - w->nsecs_start,
+			     w->nsecs_cq_filled - w->nsecs_start,
+			     w->nsecs_target - w->nsecs_start);
+#endif
+		w->is_completed = true;
+
+		/* The worker owns @next of in-flight entries */
+		w->next = worker->reclaim_seq;
+		worker->reclaim_seq = curr;
+		if (worker->reclaim_seq_end == -1)
+			worker->reclaim_seq_end = curr;
+
+		if (++worker->nr_reclaimed >= NR_RECLAIM_BATCH)
+			__return_reclaimed_reqs(worker);
+
+		nr_completed++;
 	}
-	sq->stat.nr_dispatch++;
-	sq->stat.max_nr_in_flight = max_t(int, sq->stat.max_nr_in_flight, sq->stat.nr_in_flight);
 
-	latest_db = (old_db + seq) % sq->queue_size;
-	return latest_db;
+	if (nr_completed && nvmev_vdev->config.cq_owner)
+		__post_cq_batches(worker, curr_nsecs);
+
+	worker->stat.nr_completed += nr_completed;
+
+	return nr_completed;
 }
 
-void nvmev_proc_io_cq(int cqid, int new_db, int old_db)
+/*
+ * Interrupt coalescing of I/O completion queues. An interrupt is raised once
+ * the aggregation threshold is reached or the aggregation time has passed
+ * since the first pending completion, unless coalescing is disabled for the
+ * vector. Aggregation time of 0 means no delay, which is the default.
+ */
+static bool __irq_due(struct nvmev_completion_queue *cq, unsigned long long curr_nsecs)
 {
-	struct nvmev_completion_queue *cq = nvmev_vdev->cqes[cqid];
-	int i;
-	for (i = old_db; i != new_db; i++) {
-		int sqid = cq_entry(i).sq_id;
-		if (i >= cq->queue_size) {
-			i = -1;
-			continue;
-		}
+	unsigned long long aggr_nsecs = nvmev_vdev->irq_aggr_time * 100 * 1000ULL;
 
-		/* Should check the validity here since SPDK deletes SQ immediately
-		 * before processing associated CQes */
-		if (!nvmev_vdev->sqes[sqid]) continue;
+	if (cq->irq_vector <= NR_MAX_IO_QUEUE &&
+	    test_bit(cq->irq_vector, nvmev_vdev->irq_coalesce_disabled))
+		return true;
 
-		nvmev_vdev->sqes[sqid]->stat.nr_in_flight--;
-	}
+	if (cq->nr_irq_pending > nvmev_vdev->irq_aggr_thr)
+		return true;
 
-	cq->cq_tail = new_db - 1;
-	if (new_db == -1)
-		cq->cq_tail = cq->queue_size - 1;
+	return curr_nsecs >= cq->nsecs_irq_pending + aggr_nsecs;
 }
 
-static void __fill_cq_result(struct nvmev_io_work *w)
+/*
+ * Sleep until shortly before the earliest deadline of the worker, which is
+ * either the target time of a request or the time a coalesced interrupt is
+ * due. Spin when it is within io_worker_spin_ns. The dispatcher wakes the
+ * worker up when a new request is published, or one of a peer can be stolen.
+ */
+static void __sleep_until_due(struct nvmev_io_worker *worker,
+			      unsigned long long next_nsecs)
 {
-	int sqid = w->sqid;
-	int cqid = w->cqid;
-	int sq_entry = w->sq_entry;
-	unsigned int command_id = w->command_id;
-	unsigned int status = w->status;
-	unsigned int result0 = w->result0;
-	unsigned int result1 = w->result1;
+	unsigned long long spin_nsecs = nvmev_vdev->config.io_worker_spin_ns;
+	unsigned long long curr_nsecs = __get_wallclock();
+	struct nvmev_io_ring *ring = &worker->submit_ring;
 
-	struct nvmev_completion_queue *cq = nvmev_vdev->cqes[cqid];
-	struct nvme_completion *cqe;
-	int cq_head;
+	if (worker->nr_targets > 0)
+		next_nsecs = min(next_nsecs, worker->work_queue[worker->target_heap[0]].nsecs_target);
 
-	spin_lock(&cq->entry_lock);
-	cq_head = cq->cq_head;
-	cqe = &cq_entry(cq_head);
+	if (next_nsecs <= curr_nsecs + spin_nsecs) {
+		cond_resched();
+		return;
+	}
 
-	cqe->command_id = command_id;
-	cqe->sq_id = sqid;
-	cqe->sq_head = sq_entry;
-	cqe->status = cq->phase | (status << 1);
-	cqe->result0 = result0;
-	cqe->result1 = result1;
+	set_current_state(TASK_INTERRUPTIBLE);
+	WRITE_ONCE(worker->sleeping, true);
+	smp_mb(); /* Pairs with smp_mb() in __publish_req() */
 
-	if (++cq_head == cq->queue_size) {
-		cq_head = 0;
-		cq->phase = !cq->phase;
+	/* Do not sleep through work that came in meanwhile */
+	if (ring->head == __ring_avail(ring) && !__has_copy_chunks() &&
+	    !__has_stealable_copy(worker) && !kthread_should_stop()) {
+		if (next_nsecs == ULLONG_MAX) {
+			schedule();
+		} else {
+			ktime_t expires = ns_to_ktime(next_nsecs - curr_nsecs - spin_nsecs);
+
+			schedule_hrtimeout_range(&expires, 0, HRTIMER_MODE_REL);
+		}
 	}
 
-	cq->cq_head = cq_head;
-	cq->interrupt_ready = true;
-	spin_unlock(&cq->entry_lock);
+	WRITE_ONCE(worker->sleeping, false);
+	__set_current_state(TASK_RUNNING);
 }
 
 static int nvmev_io_worker(void *data)  // 커널 스레드로 동작, 워크_큐에 쌓인 작업들을 감시하고 처리
 {
 	// 1. 전달받은 데이터를 worker 구조체로 형변환 (각 스레드별 고유 정보)
 	struct nvmev_io_worker *worker = (struct nvmev_io_worker *)data;
-	struct nvmev_ns *ns;
 	// 마지막으로 I/O가 발생한 시간을 기록 (유휴 상태 체크용)
 	static unsigned long last_io_time = 0;
 
@@ -655,111 +1676,58 @@ static int nvmev_io_worker(void *data)  // 커널 스레드로 동작, 워크_
 		   cpu_to_node(smp_processor_id()));
 
 	// 커널 스레드 중지 요청이 올 때까지 무한 루프 실행
-	while (!kthread_should_stop()) {  // 해당 루프를 돌면서 work_queue 감시
-		// 현재 실제 세계의 시간(Wall clock)과 로컬 CPU 시간을 가져와 차이(delta) 계산
-		unsigned long long curr_nsecs_wall = __get_wallclock();
-		unsigned long long curr_nsecs_local = local_clock();
-		long long delta = curr_nsecs_wall - curr_nsecs_local;
-
-		// 현재 처리해야 할 I/O 작업의 시작 인덱스 (volatile로 최신값 보장)
-		volatile unsigned int curr = worker->io_seq;  // io_seq: worker의 work queue에서 가장 먼저 처리해야 할 work의 index
+	while (!kthread_should_stop()) {
+		/* Start of this pass, for the busy time */
+		unsigned long long curr_nsecs = __get_wallclock();
+
+		/* Requests newly handed over by the dispatcher, [head, tail) */
+		struct nvmev_io_ring *ring = &worker->submit_ring;
+		unsigned int head = ring->head;
+		unsigned int tail = __ring_avail(ring);
+		unsigned long long next_irq_nsecs = ULLONG_MAX;
+		bool busy = head != tail;
+		bool cq_owner = nvmev_vdev->config.cq_owner;
 		int qidx;
 
-		// work queue를 순회하며 할 일이 있는지 확인
-		while (curr != -1) {
-			// 현재 시간을 나노초 단위로 계산 (로컬 시간 + 월클락 오차 교정)
+		if (unlikely(READ_ONCE(worker->lat_reset)))
+			__clear_latency(worker);
+
+		/*
+		 * Copy the newly dispatched requests in order and put them on the
+		 * target heap. Due requests are completed in between copies so
+		 * that a burst of large copies does not delay the completions.
+		 */
+		while (head != tail) {
+			unsigned int curr = __ring_get(ring, &head);
 			struct nvmev_io_work *w = &worker->work_queue[curr];
-			unsigned long long curr_nsecs = local_clock() + delta;
-			// worker의 마지막 처리 시간을 현재로 갱신
-			worker->latest_nsecs = curr_nsecs;
 
-			// 이미 완료된 작업이면 다음 작업으로 넘어감
-			if (w->is_completed == true) {
-				curr = w->next;
-				continue;
+			if (w->is_copied == false && __claim_copy(w, IO_COPY_OWNER)) {
+				__copy_req(worker, curr);
+				last_io_time = jiffies;
 			}
 
-			/* [데이터 복사 단계] */
-			// 아직 호스트-장치 간 데이터 복사(memcpy)가 안 되었다면 실행
-			if (w->is_copied == false) {
-#ifdef PERF_DEBUG
-				// 복사 시작 시간 기록
-				w->nsecs_copy_start = local_clock() + delta;
-#endif
-				// 내부 관리용 I/O 라면 복사 생략
-				if (w->is_internal) {
-					;
-				} else if (io_using_dma) {
-					// 설정이 DMA 사용 모드라면 DMA 에뮬레이션 함수 호출
-					__do_perform_io_using_dma(w->sqid, w->sq_entry);
-				} else {
-#if (BASE_SSD == KV_PROTOTYPE)
-					struct nvmev_submission_queue *sq =
-						nvmev_vdev->sqes[w->sqid];
-					ns = &nvmev_vdev->ns[0];
-					if (ns->identify_io_cmd(ns, sq_entry(w->sq_entry))) {
-						w->result0 = ns->perform_io_cmd(
-							ns, &sq_entry(w->sq_entry), &(w->status));
-					} else {
-						__do_perform_io(w->sqid, w->sq_entry);
-					}
-#else 
-					// 일반적인 환경에서 memcpy를 이용한 데이터 전송 실행
-					__do_perform_io(w->sqid, w->sq_entry);
-#endif
-				}
-
-#ifdef PERF_DEBUG
-				// 복사 완료 시간 기록
-				w->nsecs_copy_done = local_clock() + delta;
-#endif
-				// 복사 완료 플래그 설정 (다음 루프에서 중복 복사 방지)
-				w->is_copied = true;
-				// 마지막 I/O 발생 시점을 현재 jiffies(시스템이 부팅된 후 지금까지 몇 번의 타이머 인터럽트가 발생했는지 나타내는 전역 변수)로 갱신
-				last_io_time = jiffies;
+			__push_target(worker, curr);
+			__complete_due_reqs(worker);
+		}
+		__ring_consume(ring, head);
 
-				// 디버그 메시지: 어떤 큐의 어떤 항목을 복사했는지 출력
-				NVMEV_DEBUG_VERBOSE("%s: copied %u, %d %d %d\n", worker->thread_name, curr,
-					    w->sqid, w->cqid, w->sq_entry);
-			}
+		/* Do not hold back a partial batch while no new request arrives */
+		if (head == __ring_avail(ring))
+			__return_reclaimed_reqs(worker);
 
-			/* [지연 시간 완료 체크 단계] */
-			// FTL(conv_write 등)이 계산한 목표 시간(nsecs_target)에 도달했는지 확인
-			if (w->nsecs_target <= curr_nsecs) {
-				if (w->is_internal) {
-					// 내부 작업(GC 등) 완료 시 버퍼 자원 해제
-					// 호스트 I/O는 fill-cq-request 를 거쳐 완료됨. 완료를 확인한 상위 모듈이 버퍼를 정리
-					// 반면, 내부작업의 경우 완료 보고할 필요가 없으므로 버퍼만 해제
-#if (SUPPORTED_SSD_TYPE(CONV) || SUPPORTED_SSD_TYPE(ZNS))
-					buffer_release((struct buffer *)w->write_buffer,
-						       w->buffs_to_release);
-#endif
-				} else {
-					// 일반 호스트 I/O라면 완료 큐(CQ)에 결과 기록 (인터럽트 준비)
-					__fill_cq_result(w);
-				}
+		if (__complete_due_reqs(worker))
+			busy = true;
 
-				NVMEV_DEBUG_VERBOSE("%s: completed %u, %d %d %d\n", worker->thread_name, curr,
-					    w->sqid, w->cqid, w->sq_entry);
+		/* Help copying large commands, one chunk at a time */
+		if (__copy_queued_chunk(worker))
+			busy = true;
 
-#ifdef PERF_DEBUG
-				w->nsecs_cq_filled = local_clock() + delta;
-				trace_printk("%llu %llu %llu %llu %llu %llu\n", w->nsecs_start,
-					     w->nsecs_enqueue - w->nsecs_start,
-					     w->nsecs_copy_start - w->nsecs_start,
-					     w->nsecs_copy_done - w->nsecs_start,
-					     w->nsecs_cq_filled - w->nsecs_start,
-					     w->nsecs_target - w->nsecs_start);
-#endif
-				// 메모리 베리어: 다른 CPU나 프로세스가 이 작업의 완료 상태를 즉시 보도록 보장
-				mb(); /* Reclaimer shall see after here */
-				// 최종 완료 플래그 설정
-				w->is_completed = true;
-			}
+		/* Nothing to do on our own. Take over a copy from a loaded peer */
+		if (!busy && __steal_enabled())
+			busy = __steal_copy(worker);
 
-			// 다음 work 인덱스로 이동
-			curr = w->next;
-		}
+		if (busy)
+			worker->stat.busy_nsecs += __get_wallclock() - curr_nsecs;
 
 		/* [인터럽트 신호 전송 단계] */
 		// 시스템의 모든 완료 큐(CQ)를 돌며 호스트에게 알릴 인터럽트가 있는지 확인
@@ -777,19 +1745,36 @@ static int nvmev_io_worker(void *data)  // 커널 스레드로 동작, 워크_
 
 			// CQ의 인터럽트 상태를 안전하게 확인하기 위해 뮤텍스 락 시도
 			if (mutex_trylock(&cq->irq_lock)) {
-				// 호스트에게 보낼 인터럽트가 준비된 상태라면
-				if (cq->interrupt_ready == true) {
-#ifdef PERF_DEBUG
-					prev_clock = local_clock();
-#endif
+				bool fire = false;
+
+				// 호스트에게 보낼 인터럽트가 준비되었고 coalescing 조건을 만족하면
+				/* The owner is the only one touching the CQ in CQ owner mode */
+				if (!cq_owner)
+					spin_lock(&cq->entry_lock);
+				if (cq->interrupt_ready == true &&
+				    __irq_due(cq, worker->latest_nsecs)) {
 					// 신호를 보낼 것이므로 플래그를 false로 내림
 					cq->interrupt_ready = false;
+					cq->nr_irq_pending = 0;
+					fire = true;
+				} else if (cq->interrupt_ready == true) {
+					next_irq_nsecs = min(next_irq_nsecs,
+							     cq->nsecs_irq_pending +
+							     nvmev_vdev->irq_aggr_time * 100 * 1000ULL);
+				}
+				if (!cq_owner)
+					spin_unlock(&cq->entry_lock);
+
+				if (fire) {
+#ifdef PERF_DEBUG
+					prev_clock = __get_wallclock();
+#endif
 					// 실제로 호스트 OS에 인터럽트 신호(MSI-X 등) 발생시킴
 					nvmev_signal_irq(cq->irq_vector);
 
 #ifdef PERF_DEBUG
 					// 인터럽트 발생 오버헤드 기록 및 통계 출력
-					intr_clock[qidx] += (local_clock() - prev_clock);
+					intr_clock[qidx] += (__get_wallclock() - prev_clock);
 					intr_counter[qidx]++;
 
 					if (intr_counter[qidx] > 1000) {
@@ -806,8 +1791,11 @@ static int nvmev_io_worker(void *data)  // 커널 스레드로 동작, 워크_
 		}
 
 		/* [휴식 및 스케줄링] */
+		/* Sleep on an hrtimer if the next completion is far enough */
+		if (nvmev_vdev->config.io_worker_spin_ns != 0)
+			__sleep_until_due(worker, next_irq_nsecs);
 		// 일정 시간 동안 작업이 없으면(IDLE_TIMEOUT) 스레드를 잠시 재움
-		if (CONFIG_NVMEVIRT_IDLE_TIMEOUT != 0 &&
+		else if (CONFIG_NVMEVIRT_IDLE_TIMEOUT != 0 &&
 		    time_after(jiffies, last_io_time + (CONFIG_NVMEVIRT_IDLE_TIMEOUT * HZ)))
 			schedule_timeout_interruptible(1);
 		else
@@ -819,52 +1807,301 @@ static int nvmev_io_worker(void *data)  // 커널 스레드로 동작, 워크_
 	return 0;
 }
 
-void NVMEV_IO_WORKER_INIT(struct nvmev_dev *nvmev_vdev)
+static void __free_io_worker(struct nvmev_io_worker *worker)
+{
+	kvfree(worker->submit_ring.entries);
+	kvfree(worker->target_heap);
+	kvfree(worker->dma_batches);
+	kvfree(worker->work_queue);
+	vfree(worker->sq_lat);
+
+	worker->submit_ring.entries = NULL;
+	worker->target_heap = NULL;
+	worker->dma_batches = NULL;
+	worker->work_queue = NULL;
+	worker->sq_lat = NULL;
+}
+
+/*
+ * On failure, the buffers of a slot used for the first time are freed. Those
+ * of a removed worker are kept, as peers may still look at them.
+ */
+static int __init_io_worker(struct nvmev_io_worker *worker, unsigned int worker_id,
+			   unsigned int cpu_nr)
 {
-	unsigned int i, worker_id;
+	unsigned int i;
+	unsigned int depth = nvmev_vdev->config.io_queue_depth;
+	/* The worker touches these all the time. Keep them on its node */
+	int node = cpu_to_node(cpu_nr);
+	bool is_new = !worker->work_queue;
+	int ret;
+
+	/* A worker added back after removal reuses its buffers */
+	if (!worker->work_queue)
+		worker->work_queue =
+			kvzalloc_node(sizeof(struct nvmev_io_work) * depth, GFP_KERNEL, node);
+	if (!worker->submit_ring.entries)
+		worker->submit_ring.entries =
+			kvzalloc_node(sizeof(unsigned int) * depth, GFP_KERNEL, node);
+	if (!worker->target_heap)
+		worker->target_heap = kvzalloc_node(sizeof(unsigned int) * depth, GFP_KERNEL, node);
+	if (io_using_dma && !worker->dma_batches)
+		worker->dma_batches =
+			kvzalloc_node(sizeof(struct ioat_dma_batch) * depth, GFP_KERNEL, node);
+	if (!worker->sq_lat)
+		worker->sq_lat =
+			vzalloc_node(sizeof(struct nvmev_sq_lat) * (NR_MAX_IO_QUEUE + 1), node);
+
+	if (!worker->work_queue || !worker->submit_ring.entries || !worker->target_heap ||
+	    (io_using_dma && !worker->dma_batches) || !worker->sq_lat) {
+		ret = -ENOMEM;
+		goto err_free;
+	}
 
-	nvmev_vdev->io_workers =
-		kcalloc(nvmev_vdev->config.nr_io_workers, sizeof(struct nvmev_io_worker), GFP_KERNEL);
-	nvmev_vdev->io_worker_turn = 0;
+	for (i = 0; i < depth; i++) {
+		worker->work_queue[i].next = i + 1;
+	}
+	worker->work_queue[depth - 1].next = -1;
+	worker->id = worker_id;
+	worker->free_seq = 0;
+	worker->nr_allocated = 0;
+	worker->ret_seq = -1;
+	worker->nr_returned = 0;
+	worker->reclaim_seq = -1;
+	worker->reclaim_seq_end = -1;
+	worker->nr_reclaimed = 0;
+
+	worker->submit_ring.head = worker->submit_ring.tail = 0;
+	worker->submit_ring.mask = depth - 1;
+	worker->nr_targets = 0;
+	bitmap_zero(worker->cq_staged, NR_MAX_IO_QUEUE + 1);
+
+	worker->latest_nsecs = 0;
+	worker->sleeping = false;
+	memset(&worker->stat, 0, sizeof(worker->stat));
+	memset(&worker->stat_prev, 0, sizeof(worker->stat_prev));
+	worker->stat_clock_prev = 0;
+	worker->stat_reset_max = false;
+
+	snprintf(worker->thread_name, sizeof(worker->thread_name), "nvmev_io_worker_%d", worker_id);
+
+	/* Drop the reference on the thread of a previous incarnation */
+	if (worker->task_struct)
+		put_task_struct(worker->task_struct);
+
+	worker->task_struct = kthread_create_on_node(nvmev_io_worker, worker, node, "%s",
+						     worker->thread_name);
+	if (IS_ERR(worker->task_struct)) {
+		ret = PTR_ERR(worker->task_struct);
+		worker->task_struct = NULL;
+		goto err_free;
+	}
 
-	for (worker_id = 0; worker_id < nvmev_vdev->config.nr_io_workers; worker_id++) {
-		struct nvmev_io_worker *worker = &nvmev_vdev->io_workers[worker_id];
+	/*
+	 * Peers may still wake_up_process() a removed worker through a stale
+	 * scan. Pin the task_struct so that stays harmless.
+	 */
+	get_task_struct(worker->task_struct);
 
-		worker->work_queue =
-			kzalloc(sizeof(struct nvmev_io_work) * NR_MAX_PARALLEL_IO, GFP_KERNEL);
-		for (i = 0; i < NR_MAX_PARALLEL_IO; i++) {
-			worker->work_queue[i].next = i + 1;
-			worker->work_queue[i].prev = i - 1;
+	kthread_bind(worker->task_struct, cpu_nr);
+	wake_up_process(worker->task_struct);
+
+	return 0;
+
+err_free:
+	NVMEV_ERROR("Cannot start nvmev_io_worker_%u (%d)\n", worker_id, ret);
+	if (is_new)
+		__free_io_worker(worker);
+	return ret;
+}
+
+/*
+ * Wait for @worker to complete everything queued to it. Nothing must be
+ * routed to it anymore. Its requests stay on the target heap until their
+ * chunks and the copies stolen by peers are done, so those are waited for
+ * as well.
+ */
+static void __drain_io_worker(struct nvmev_io_worker *worker)
+{
+	unsigned long warn = jiffies + 10 * HZ;
+
+	while (smp_load_acquire(&worker->submit_ring.head) != READ_ONCE(worker->submit_ring.tail) ||
+	       READ_ONCE(worker->nr_targets) > 0) {
+		if (time_after(jiffies, warn)) {
+			NVMEV_INFO("Still waiting for %s to drain\n", worker->thread_name);
+			warn = jiffies + 10 * HZ;
 		}
-		worker->work_queue[NR_MAX_PARALLEL_IO - 1].next = -1;
-		worker->id = worker_id;
-		worker->free_seq = 0;
-		worker->free_seq_end = NR_MAX_PARALLEL_IO - 1;
-		worker->io_seq = -1;
-		worker->io_seq_end = -1;
+		msleep(1);
+	}
+}
+
+/* Wait until every chunk queued so far has been taken off the chunk queue */
+static void __drain_copy_chunks(void)
+{
+	struct nvmev_copy_chunk_queue *q = &nvmev_vdev->copy_chunks;
+	unsigned int tail = READ_ONCE(q->tail);
+
+	while ((int)(READ_ONCE(q->head) - tail) < 0)
+		msleep(1);
+}
+
+/*
+ * The SQ-to-worker mapping changes with the size of the pool. In CQ owner
+ * mode, a CQ must not get a new owner while the old one may still post to
+ * it, so the dispatchers hold the IO SQs and every worker is drained until
+ * __resume_io_dispatch().
+ */
+static void __quiesce_io_workers(void)
+{
+	unsigned int i;
+
+	if (!nvmev_vdev->config.cq_owner)
+		return;
+
+	WRITE_ONCE(nvmev_vdev->io_dispatch_paused, true);
+	nvmev_sync_dispatchers();
+
+	for (i = 0; i < nvmev_vdev->config.nr_io_workers; i++)
+		__drain_io_worker(&nvmev_vdev->io_workers[i]);
+}
+
+static void __resume_io_dispatch(void)
+{
+	/* Publishes the new pool along with it */
+	smp_store_release(&nvmev_vdev->io_dispatch_paused, false);
+}
+
+/* Add an IO worker on @cpu_nr at the end of the pool */
+int nvmev_add_io_worker(unsigned int cpu_nr)
+{
+	struct nvmev_config *config = &nvmev_vdev->config;
+	unsigned int worker_id = config->nr_io_workers;
+	int ret;
+
+	if (worker_id >= ARRAY_SIZE(config->cpu_nr_io_workers)) {
+		NVMEV_ERROR("Cannot have more than %zu IO workers\n",
+			    ARRAY_SIZE(config->cpu_nr_io_workers));
+		return -ENOSPC;
+	}
+
+	if (cpu_nr >= nr_cpu_ids || !cpu_online(cpu_nr)) {
+		NVMEV_ERROR("CPU %u is not online\n", cpu_nr);
+		return -EINVAL;
+	}
+
+	__quiesce_io_workers();
+
+	ret = __init_io_worker(&nvmev_vdev->io_workers[worker_id], worker_id, cpu_nr);
+	if (!ret) {
+		config->cpu_nr_io_workers[worker_id] = cpu_nr;
+		/* Dispatchers start routing to it from their next pass */
+		smp_store_release(&config->nr_io_workers, worker_id + 1);
+	}
+
+	__resume_io_dispatch();
+
+	if (ret)
+		return ret;
+
+	NVMEV_INFO("Added %s on CPU %u\n", nvmev_vdev->io_workers[worker_id].thread_name, cpu_nr);
+	return 0;
+}
+
+/*
+ * Remove the last IO worker of the pool. Only the departing worker is
+ * quiesced: the dispatchers stop routing to it, and it is stopped once it
+ * has completed everything queued to it and the chunk queue has moved past
+ * the chunks it may have left there.
+ *
+ * The worker memory is kept until the module is unloaded. Peers that
+ * scanned the pool before it shrank may still look at it.
+ */
+int nvmev_remove_io_worker(void)
+{
+	struct nvmev_config *config = &nvmev_vdev->config;
+	unsigned int worker_id = config->nr_io_workers - 1;
+	struct nvmev_io_worker *worker = &nvmev_vdev->io_workers[worker_id];
+
+	/* Every dispatcher needs a worker of its own under BY_SQ sharding */
+	if (config->nr_io_workers <= config->nr_dispatchers) {
+		NVMEV_ERROR("Cannot have fewer IO workers than dispatchers (%u)\n",
+			    config->nr_dispatchers);
+		return -EINVAL;
+	}
+
+	__quiesce_io_workers();
+
+	smp_store_release(&config->nr_io_workers, worker_id);
+	/* Requests routed by the old pool are in its ring once this returns */
+	nvmev_sync_dispatchers();
 
-		snprintf(worker->thread_name, sizeof(worker->thread_name), "nvmev_io_worker_%d", worker_id);
+	__drain_io_worker(worker);
+	__drain_copy_chunks();
+	kthread_stop(worker->task_struct);
 
-		worker->task_struct = kthread_create(nvmev_io_worker, worker, "%s", worker->thread_name);
+	__resume_io_dispatch();
 
-		kthread_bind(worker->task_struct, nvmev_vdev->config.cpu_nr_io_workers[worker_id]);
-		wake_up_process(worker->task_struct);
+	NVMEV_INFO("Removed %s\n", worker->thread_name);
+	return 0;
+}
+
+int NVMEV_IO_WORKER_INIT(struct nvmev_dev *nvmev_vdev)
+{
+	unsigned int worker_id;
+	int ret;
+
+	BUILD_BUG_ON(NR_MAX_COPY_CHUNKS & COPY_CHUNK_MASK);
+
+	spin_lock_init(&nvmev_vdev->copy_chunks.lock);
+	nvmev_vdev->copy_chunks.chunks =
+		kcalloc(NR_MAX_COPY_CHUNKS, sizeof(struct nvmev_copy_chunk), GFP_KERNEL);
+	nvmev_vdev->copy_chunks.head = nvmev_vdev->copy_chunks.tail = 0;
+
+	/* Sized for the largest pool so that resizing never moves a worker */
+	nvmev_vdev->io_workers = kcalloc(ARRAY_SIZE(nvmev_vdev->config.cpu_nr_io_workers),
+					 sizeof(struct nvmev_io_worker), GFP_KERNEL);
+
+	if (!nvmev_vdev->copy_chunks.chunks || !nvmev_vdev->io_workers) {
+		ret = -ENOMEM;
+		goto err;
 	}
+
+	for (worker_id = 0; worker_id < nvmev_vdev->config.nr_io_workers; worker_id++) {
+		ret = __init_io_worker(&nvmev_vdev->io_workers[worker_id], worker_id,
+				       nvmev_vdev->config.cpu_nr_io_workers[worker_id]);
+		if (ret)
+			goto err;
+	}
+
+	return 0;
+
+err:
+	/* Stops the workers started so far */
+	NVMEV_IO_WORKER_FINAL(nvmev_vdev);
+	return ret;
 }
 
 void NVMEV_IO_WORKER_FINAL(struct nvmev_dev *nvmev_vdev)
 {
+	/* Nothing to stop if the pool was never allocated */
+	unsigned int nr_slots =
+		nvmev_vdev->io_workers ? ARRAY_SIZE(nvmev_vdev->config.cpu_nr_io_workers) : 0;
 	unsigned int i;
 
-	for (i = 0; i < nvmev_vdev->config.nr_io_workers; i++) {
+	for (i = 0; i < nr_slots; i++) {
 		struct nvmev_io_worker *worker = &nvmev_vdev->io_workers[i];
 
-		if (!IS_ERR_OR_NULL(worker->task_struct)) {
+		/* Removed workers were stopped already */
+		if (i < nvmev_vdev->config.nr_io_workers && worker->task_struct)
 			kthread_stop(worker->task_struct);
-		}
+		if (worker->task_struct)
+			put_task_struct(worker->task_struct);
 
-		kfree(worker->work_queue);
+		__free_io_worker(worker);
 	}
 
 	kfree(nvmev_vdev->io_workers);
+	nvmev_vdev->io_workers = NULL;
+	kfree(nvmev_vdev->copy_chunks.chunks);
+	nvmev_vdev->copy_chunks.chunks = NULL;
 }
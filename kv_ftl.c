@@ -21,7 +21,7 @@ static const struct allocator_ops bitmap_ops = {
 
 static inline unsigned long long __get_wallclock(void)
 {
-	return cpu_clock(nvmev_vdev->config.cpu_nr_dispatcher);
+	return nvmev_clock();
 }
 
 static size_t __cmd_io_size(struct nvme_rw_command *cmd)
@@ -506,15 +506,11 @@ static unsigned int __do_perform_kv_io(struct kv_ftl *kv_ftl, struct nvme_kv_com
 				       unsigned int *status)
 {
 	size_t offset;
-	size_t length, remaining;
-	int prp_offs = 0;
-	int prp2_offs = 0;
-	u64 paddr;
-	u64 *paddr_list = NULL;
-	size_t mem_offs = 0;
+	size_t length;
 	size_t new_offset = 0;
 	struct mapping_entry entry;
 	int is_insert = 0;
+	unsigned int copy_status;
 
 	entry = get_mapping_entry(kv_ftl, cmd);
 	offset = entry.mem_offset;
@@ -580,53 +576,16 @@ static unsigned int __do_perform_kv_io(struct kv_ftl *kv_ftl, struct nvme_kv_com
 
 		return 0;
 	}
-	remaining = length;
-
-	while (remaining) {
-		size_t io_size;
-		void *vaddr;
-
-		mem_offs = 0;
-		prp_offs++;
-		if (prp_offs == 1) {
-			paddr = kv_io_cmd_value_prp(cmd, 1);
-		} else if (prp_offs == 2) {
-			paddr = kv_io_cmd_value_prp(cmd, 2);
-			if (remaining > PAGE_SIZE) {
-				paddr_list = kmap_atomic_pfn(PRP_PFN(paddr)) +
-					     (paddr & PAGE_OFFSET_MASK);
-				paddr = paddr_list[prp2_offs++];
-			}
-		} else {
-			paddr = paddr_list[prp2_offs++];
-		}
-
-		vaddr = kmap_atomic_pfn(PRP_PFN(paddr));
-
-		io_size = min_t(size_t, remaining, PAGE_SIZE);
-
-		if (paddr & PAGE_OFFSET_MASK) { // 일반 block io면 언제 여기에 해당?
-			mem_offs = paddr & PAGE_OFFSET_MASK;
-			if (io_size + mem_offs > PAGE_SIZE)
-				io_size = PAGE_SIZE - mem_offs;
-		}
-		if (cmd.common.opcode == nvme_cmd_kv_store) {
-			memcpy(nvmev_vdev->storage_mapped + offset, vaddr + mem_offs, io_size);
-		} else if (cmd.common.opcode == nvme_cmd_kv_retrieve) {
-			memcpy(vaddr + mem_offs, nvmev_vdev->storage_mapped + offset, io_size);
-		} else {
-			NVMEV_ERROR("Wrong KV Command passed to NVMeVirt!!\n");
-		}
-
-		kunmap_atomic(vaddr);
-
-		remaining -= io_size;
-		offset += io_size;
+	copy_status = nvmev_copy_data_ptr(cmd.common.flags, kv_io_cmd_value_prp(cmd, 1),
+					  kv_io_cmd_value_prp(cmd, 2),
+					  nvmev_vdev->storage_mapped + offset, length,
+					  cmd.common.opcode == nvme_cmd_kv_retrieve);
+	if (copy_status != NVME_SC_SUCCESS) {
+		/* Do not map a value that did not make it */
+		*status = copy_status;
+		return 0;
 	}
 
-	if (paddr_list != NULL)
-		kunmap_atomic(paddr_list);
-
 	if (is_insert == 1) { // need to make new mapping
 		new_mapping_entry(kv_ftl, cmd, new_offset);
 	} else if (is_insert == 2) {
@@ -691,13 +650,7 @@ static unsigned int __do_perform_kv_batched_io(struct kv_ftl *kv_ftl, int opcode
 static unsigned int __do_perform_kv_batch(struct kv_ftl *kv_ftl, struct nvme_kv_command cmd,
 					  unsigned int *status)
 {
-	size_t offset;
-	size_t length, remaining;
-	int prp_offs = 0;
-	int prp2_offs = 0;
-	u64 paddr;
-	u64 *paddr_list = NULL;
-	size_t mem_offs = 0;
+	size_t length;
 	int i;
 	struct payload_format *payload;
 	char *buffer = NULL;
@@ -705,6 +658,7 @@ static unsigned int __do_perform_kv_batch(struct kv_ftl *kv_ftl, struct nvme_kv_
 	char *value;
 	int sub_cmd_cnt;
 	int opcode, sub_len, key_len, val_len, payload_offset = 0;
+	unsigned int copy_status;
 
 	sub_cmd_cnt = cmd.kv_batch.rsvd4;
 	length = cmd_value_length(cmd);
@@ -714,46 +668,12 @@ static unsigned int __do_perform_kv_batch(struct kv_ftl *kv_ftl, struct nvme_kv_
 
 	//printk("kv_batch %d %d", sub_cmd_cnt, length);
 
-	remaining = length;
-	offset = 0;
-
-	while (remaining) {
-		size_t io_size;
-		void *vaddr;
-
-		mem_offs = 0;
-		prp_offs++;
-		if (prp_offs == 1) {
-			paddr = kv_io_cmd_value_prp(cmd, 1);
-		} else if (prp_offs == 2) {
-			paddr = kv_io_cmd_value_prp(cmd, 2);
-			if (remaining > PAGE_SIZE) {
-				paddr_list = kmap_atomic_pfn(PRP_PFN(paddr)) +
-					     (paddr & PAGE_OFFSET_MASK);
-				paddr = paddr_list[prp2_offs++];
-			}
-		} else {
-			paddr = paddr_list[prp2_offs++];
-		}
-
-		vaddr = kmap_atomic_pfn(PRP_PFN(paddr));
-
-		io_size = min_t(size_t, remaining, PAGE_SIZE);
-
-		if (paddr & PAGE_OFFSET_MASK) { // 일반 block io면 언제 여기에 해당?
-			mem_offs = paddr & PAGE_OFFSET_MASK;
-			if (io_size + mem_offs > PAGE_SIZE)
-				io_size = PAGE_SIZE - mem_offs;
-		}
-
-		NVMEV_DEBUG("Value write length %lu to position %lu, io size: %ld, mem_off: %lu\n",
-			    remaining, offset, io_size, mem_offs);
-		memcpy(buffer + offset, vaddr + mem_offs, io_size);
-
-		kunmap_atomic(vaddr);
-
-		remaining -= io_size;
-		offset += io_size;
+	copy_status = nvmev_copy_data_ptr(cmd.common.flags, kv_io_cmd_value_prp(cmd, 1),
+					  kv_io_cmd_value_prp(cmd, 2), buffer, length, false);
+	if (copy_status != NVME_SC_SUCCESS) {
+		/* The payload is not all there. Run none of the sub-commands */
+		*status = copy_status;
+		sub_cmd_cnt = 0;
 	}
 
 	/* perform KV IO for sub-payload */
@@ -784,9 +704,6 @@ static unsigned int __do_perform_kv_batch(struct kv_ftl *kv_ftl, struct nvme_kv_
 
 	NVMEV_DEBUG("finished kv_batch with %d sub-commands", sub_cmd_cnt);
 
-	if (paddr_list != NULL)
-		kunmap_atomic(paddr_list);
-
 	if (value != NULL)
 		kfree(value);
 
@@ -847,10 +764,6 @@ static unsigned int kv_iter_read(struct kv_ftl *kv_ftl, struct nvme_kv_command c
 	int pos = 0, keylen = 16, buf_offset = 4, nr_keys = 0;
 	unsigned int key;
 	bool full = false, end = false;
-	size_t remaining, mem_offs = 0, offset;
-	int prp_offs = 0, prp2_offs = 0;
-	u64 paddr;
-	u64 *paddr_list = NULL;
 
 	if (handle == NULL) {
 		NVMEV_ERROR("Invalid Iterator Handle");
@@ -893,54 +806,9 @@ static unsigned int kv_iter_read(struct kv_ftl *kv_ftl, struct nvme_kv_command c
 	handle->current_pos = pos;
 
 	/* Writing buffer to PRP */
-	remaining = buf_offset;
-	offset = 0;
-
-	while (remaining) {
-		size_t io_size;
-		void *vaddr;
-
-		mem_offs = 0;
-		prp_offs++;
-		if (prp_offs == 1) {
-			paddr = kv_io_cmd_value_prp(cmd, 1);
-		} else if (prp_offs == 2) {
-			paddr = kv_io_cmd_value_prp(cmd, 2);
-			if (remaining > PAGE_SIZE) {
-				paddr_list = kmap_atomic_pfn(PRP_PFN(paddr)) +
-					     (paddr & PAGE_OFFSET_MASK);
-				paddr = paddr_list[prp2_offs++];
-			}
-		} else {
-			paddr = paddr_list[prp2_offs++];
-		}
-
-		vaddr = kmap_atomic_pfn(PRP_PFN(paddr));
-
-		io_size = min_t(size_t, remaining, PAGE_SIZE);
-
-		if (paddr & PAGE_OFFSET_MASK) {
-			mem_offs = paddr & PAGE_OFFSET_MASK;
-			if (io_size + mem_offs > PAGE_SIZE)
-				io_size = PAGE_SIZE - mem_offs;
-		}
-
-		NVMEV_DEBUG(
-			"Buffer transfer, length %lu from position %lu, io size: %ld, mem_off: %lu\n",
-			remaining, offset, io_size, mem_offs);
-		memcpy(vaddr + mem_offs, handle->buf + offset, io_size);
-
-		kunmap_atomic(vaddr);
-
-		remaining -= io_size;
-		offset += io_size;
-	}
-
-	if (paddr_list != NULL)
-		kunmap_atomic(paddr_list);
-
-	*status = 0;
-	if (end) {
+	*status = nvmev_copy_data_ptr(cmd.common.flags, kv_io_cmd_value_prp(cmd, 1),
+				      kv_io_cmd_value_prp(cmd, 2), handle->buf, buf_offset, true);
+	if (*status == NVME_SC_SUCCESS && end) {
 		*status = 0x393;
 	}
 
@@ -8,6 +8,8 @@
 #include <linux/proc_fs.h>
 #include <linux/seq_file.h>
 #include <linux/delay.h>
+#include <linux/log2.h>
+#include <linux/mm.h>
 #include <linux/uaccess.h>
 #include <linux/version.h>
 
@@ -71,9 +73,20 @@ static unsigned int nr_io_units = 8;
 static unsigned int io_unit_shift = 12;
 
 static char *cpus;
+static unsigned int nr_dispatchers = 1;
+static unsigned int io_worker_spin_ns = 0;
+static unsigned int io_queue_depth = NR_MAX_PARALLEL_IO;
+static unsigned int nt_copy_threshold = 0;
+static unsigned int copy_chunk_size = 0;
+static bool io_worker_steal = false;
+static bool ftl_numa_local = false;
+static bool cq_owner = false;
+static unsigned int bg_gc_low = 0;
+static unsigned int bg_gc_high = 0;
+static char *dma_chans;
 static unsigned int debug = 0;
 
-int io_using_dma = false;
+bool io_using_dma = false;
 
 static int set_parse_mem_param(const char *val, const struct kernel_param *kp)
 {
@@ -109,17 +122,182 @@ module_param(io_unit_shift, uint, 0444);
 MODULE_PARM_DESC(io_unit_shift, "Size of each I/O unit (2^)");
 module_param(cpus, charp, 0444);
 MODULE_PARM_DESC(cpus, "CPU list for process, completion(int.) threads, Seperated by Comma(,)");
+module_param(nr_dispatchers, uint, 0444);
+MODULE_PARM_DESC(nr_dispatchers, "Number of dispatchers, which take the first CPUs in the cpus list");
+module_param(io_worker_spin_ns, uint, 0444);
+MODULE_PARM_DESC(io_worker_spin_ns,
+		 "IO workers sleep until this many nanoseconds before the next deadline (0: always spin)");
+module_param(io_queue_depth, uint, 0444);
+MODULE_PARM_DESC(io_queue_depth,
+		 "Commands in flight per IO worker, rounded up to a power of 2. SQs back off when it is reached");
+module_param(nt_copy_threshold, uint, 0444);
+MODULE_PARM_DESC(nt_copy_threshold,
+		 "Copy writes of this many bytes or more with non-temporal stores (0: disable)");
+module_param(copy_chunk_size, uint, 0444);
+MODULE_PARM_DESC(copy_chunk_size,
+		 "Split copies larger than this many bytes into chunks for idle IO workers (0: disable)");
+module_param(io_worker_steal, bool, 0444);
+MODULE_PARM_DESC(io_worker_steal, "Let idle IO workers copy requests queued on loaded ones");
+module_param(ftl_numa_local, bool, 0444);
+MODULE_PARM_DESC(ftl_numa_local, "Allocate FTL metadata of each partition on the node of a dispatcher");
+module_param(cq_owner, bool, 0444);
+MODULE_PARM_DESC(cq_owner, "Route the SQs of a CQ to one IO worker, which posts its completions in batches without locking");
+module_param(bg_gc_low, uint, 0444);
+MODULE_PARM_DESC(bg_gc_low,
+		 "Percentage of free lines below which idle-time GC also reclaims lines with many valid pages");
+module_param(bg_gc_high, uint, 0444);
+MODULE_PARM_DESC(bg_gc_high,
+		 "Percentage of free lines idle-time GC tries to keep in each partition (default: 0, disabled)");
+module_param(dma_chans, charp, 0444);
+MODULE_PARM_DESC(dma_chans,
+		 "DMA channels to copy data with, Seperated by Comma(,), or 'any' for all memcpy channels");
 module_param(debug, uint, 0644);
 
+/* Once the host has set up a Doorbell Buffer Config, I/O queue doorbells go to the shadow */
+static inline int __read_io_db(u32 *dbbuf_dbs, int dbs_idx)
+{
+	int db;
+
+	if (!dbbuf_dbs)
+		return nvmev_vdev->dbs[dbs_idx];
+
+	db = READ_ONCE(dbbuf_dbs[nvmev_dbbuf_idx(dbs_idx)]);
+	smp_rmb(); /* The host fills the queue entries before updating the shadow */
+
+	return db;
+}
+
+/*
+ * The host writes a doorbell register only when the new value passes
+ * EventIdx. The dispatchers keep polling, so EventIdx stays right behind
+ * the last value seen and the host never has to.
+ */
+static inline void __update_event_idx(u32 *dbbuf_eis, int dbs_idx)
+{
+	if (dbbuf_eis)
+		WRITE_ONCE(dbbuf_eis[nvmev_dbbuf_idx(dbs_idx)], nvmev_vdev->old_dbs[dbs_idx] - 1);
+}
+
+/* Whether @dispatcher serves @sq. In CQ owner mode, SQs go with the shard of their CQ */
+static inline bool __is_dispatched_by(struct nvmev_dispatcher *dispatcher,
+				      struct nvmev_submission_queue *sq)
+{
+	const unsigned int nr_dispatchers = nvmev_vdev->config.nr_dispatchers;
+
+	if (nr_dispatchers == 1)
+		return true;
+
+	return ((nvmev_vdev->config.cq_owner ? sq->cqid : sq->qid) - 1) % nr_dispatchers ==
+	       dispatcher->id;
+}
+
+/* Launch up to @max_proc commands from @sq. Returns how many were launched */
+static unsigned int __proc_io_sq(struct nvmev_submission_queue *sq, unsigned int max_proc,
+				 u32 *dbbuf_dbs, u32 *dbbuf_eis)
+{
+	int dbs_idx = sq->qid * 2;
+	int new_db = __read_io_db(dbbuf_dbs, dbs_idx);
+	int old_db = nvmev_vdev->old_dbs[dbs_idx];
+	int latest_db;
+
+	if (new_db == old_db)
+		return 0;
+
+	latest_db = nvmev_proc_io_sq(sq, new_db, old_db, max_proc);
+	nvmev_vdev->old_dbs[dbs_idx] = latest_db;
+	__update_event_idx(dbbuf_eis, dbs_idx);
+
+	return (latest_db - old_db + sq->queue_size) % sq->queue_size;
+}
+
+/*
+ * One round robin turn over the SQs of @dispatcher in priority class @prio,
+ * or all of them with -1. Each SQ launches up to @burst commands, taken from
+ * the @credits of the class. Returns true if any command was launched.
+ */
+static bool __arbitrate_round(struct nvmev_dispatcher *dispatcher, int prio, unsigned int burst,
+			      unsigned int *credits, u32 *dbbuf_dbs, u32 *dbbuf_eis)
+{
+	bool launched = false;
+	int qid;
+
+	for (qid = 1; qid <= nvmev_vdev->nr_sq && *credits > 0; qid++) {
+		/*
+		 * Dispatcher 0 may delete the SQ meanwhile. It waits for a pass of
+		 * every dispatcher before freeing it, so this copy stays valid.
+		 */
+		struct nvmev_submission_queue *sq = READ_ONCE(nvmev_vdev->sqes[qid]);
+		unsigned int nr_proc;
+
+		if (sq == NULL || !__is_dispatched_by(dispatcher, sq))
+			continue;
+		if (prio >= 0 && sq->priority != prio)
+			continue;
+
+		nr_proc = __proc_io_sq(sq, min(burst, *credits), dbbuf_dbs, dbbuf_eis);
+		if (nr_proc) {
+			*credits -= nr_proc;
+			launched = true;
+		}
+	}
+
+	return launched;
+}
+
+/*
+ * NVMe arbitration among the I/O SQs, selected by CC.AMS. Round robin gives
+ * every SQ one turn per pass. Weighted round robin serves the urgent class
+ * first until it runs dry, then the high, medium and low classes, each up to
+ * its weight in commands.
+ */
+static bool __arbitrate_io_sqs(struct nvmev_dispatcher *dispatcher, u32 *dbbuf_dbs, u32 *dbbuf_eis)
+{
+	static const int prios[] = { NVME_SQ_PRIO_HIGH, NVME_SQ_PRIO_MEDIUM, NVME_SQ_PRIO_LOW };
+	u32 arb = READ_ONCE(nvmev_vdev->arbitration);
+	unsigned int burst =
+		NVME_ARB_AB(arb) == NVME_ARB_AB_NOLIMIT ? UINT_MAX : 1U << NVME_ARB_AB(arb);
+	unsigned int weights[] = {
+		NVME_ARB_HPW(arb) + 1,
+		NVME_ARB_MPW(arb) + 1,
+		NVME_ARB_LPW(arb) + 1,
+	};
+	unsigned int credits = UINT_MAX;
+	bool updated = false;
+	int i;
+
+	if (READ_ONCE(nvmev_vdev->ams) != NVME_CC_AMS_WRRU)
+		return __arbitrate_round(dispatcher, -1, burst, &credits, dbbuf_dbs, dbbuf_eis);
+
+	while (__arbitrate_round(dispatcher, NVME_SQ_PRIO_URGENT, burst, &credits, dbbuf_dbs,
+				 dbbuf_eis))
+		updated = true;
+
+	for (i = 0; i < ARRAY_SIZE(prios); i++) {
+		credits = weights[i];
+		while (credits > 0 &&
+		       __arbitrate_round(dispatcher, prios[i], burst, &credits, dbbuf_dbs, dbbuf_eis))
+			updated = true;
+	}
+
+	return updated;
+}
+
 // Returns true if an event is processed
-static bool nvmev_proc_dbs(void)
+static bool nvmev_proc_dbs(struct nvmev_dispatcher *dispatcher)
 {
+	const unsigned int nr_dispatchers = nvmev_vdev->config.nr_dispatchers;
+	u32 *dbbuf_dbs = smp_load_acquire(&nvmev_vdev->dbbuf_dbs);
+	u32 *dbbuf_eis = READ_ONCE(nvmev_vdev->dbbuf_eis);
 	int qid;
 	int dbs_idx;
 	int new_db;
 	int old_db;
 	bool updated = false;
 
+	/* I/O queues are sharded over dispatchers. The first one also serves the admin queue */
+	if (dispatcher->id != 0)
+		goto io_queues;
+
 	// Admin queue
 	new_db = nvmev_vdev->dbs[0];
 	if (new_db != nvmev_vdev->old_dbs[0]) {
@@ -134,29 +312,25 @@ static bool nvmev_proc_dbs(void)
 		updated = true;
 	}
 
+io_queues:
 	// Submission queues
-	for (qid = 1; qid <= nvmev_vdev->nr_sq; qid++) {
-		if (nvmev_vdev->sqes[qid] == NULL)
-			continue;
-		dbs_idx = qid * 2;
-		new_db = nvmev_vdev->dbs[dbs_idx];
-		old_db = nvmev_vdev->old_dbs[dbs_idx];
-		if (new_db != old_db) {
-			nvmev_vdev->old_dbs[dbs_idx] = nvmev_proc_io_sq(qid, new_db, old_db);
-			updated = true;
-		}
-	}
+	if (!READ_ONCE(nvmev_vdev->io_dispatch_paused) &&
+	    __arbitrate_io_sqs(dispatcher, dbbuf_dbs, dbbuf_eis))
+		updated = true;
 
 	// Completion queues
-	for (qid = 1; qid <= nvmev_vdev->nr_cq; qid++) {
-		if (nvmev_vdev->cqes[qid] == NULL)
+	for (qid = dispatcher->id + 1; qid <= nvmev_vdev->nr_cq; qid += nr_dispatchers) {
+		struct nvmev_completion_queue *cq = READ_ONCE(nvmev_vdev->cqes[qid]);
+
+		if (cq == NULL)
 			continue;
 		dbs_idx = qid * 2 + 1;
-		new_db = nvmev_vdev->dbs[dbs_idx];
+		new_db = __read_io_db(dbbuf_dbs, dbs_idx);
 		old_db = nvmev_vdev->old_dbs[dbs_idx];
 		if (new_db != old_db) {
-			nvmev_proc_io_cq(qid, new_db, old_db);
+			nvmev_proc_io_cq(cq, new_db, old_db);
 			nvmev_vdev->old_dbs[dbs_idx] = new_db;
+			__update_event_idx(dbbuf_eis, dbs_idx);
 			updated = true;
 		}
 	}
@@ -164,19 +338,36 @@ static bool nvmev_proc_dbs(void)
 	return updated;
 }
 
+static void nvmev_proc_idle(struct nvmev_dispatcher *dispatcher)
+{
+	unsigned int i;
+
+	for (i = 0; i < nvmev_vdev->nr_ns; i++) {
+		struct nvmev_ns *ns = &nvmev_vdev->ns[i];
+
+		if (ns->proc_idle)
+			ns->proc_idle(ns, dispatcher->id);
+	}
+}
+
 static int nvmev_dispatcher(void *data)
 {
-	static unsigned long last_dispatched_time = 0;
+	struct nvmev_dispatcher *dispatcher = (struct nvmev_dispatcher *)data;
+	unsigned long last_dispatched_time = 0;
 
-	NVMEV_INFO("nvmev_dispatcher started on cpu %d (node %d)\n",
-		   nvmev_vdev->config.cpu_nr_dispatcher,
-		   cpu_to_node(nvmev_vdev->config.cpu_nr_dispatcher));
+	NVMEV_INFO("%s started on cpu %d (node %d)\n", dispatcher->thread_name,
+		   dispatcher->cpu_nr, cpu_to_node(dispatcher->cpu_nr));
 
 	while (!kthread_should_stop()) {
-		if (nvmev_proc_bars())
+		if (dispatcher->id == 0 && nvmev_proc_bars())
 			last_dispatched_time = jiffies;
-		if (nvmev_proc_dbs())
+		if (nvmev_proc_dbs(dispatcher))
 			last_dispatched_time = jiffies;
+		else
+			nvmev_proc_idle(dispatcher);
+
+		/* Pairs with smp_mb() in nvmev_sync_dispatchers() */
+		smp_store_mb(dispatcher->pass_seq, dispatcher->pass_seq + 1);
 
 		if (CONFIG_NVMEVIRT_IDLE_TIMEOUT != 0 &&
 		    time_after(jiffies, last_dispatched_time + (CONFIG_NVMEVIRT_IDLE_TIMEOUT * HZ)))
@@ -188,22 +379,116 @@ static int nvmev_dispatcher(void *data)
 	return 0;
 }
 
-static void NVMEV_DISPATCHER_INIT(struct nvmev_dev *nvmev_vdev)
+static void NVMEV_DISPATCHER_FINAL(struct nvmev_dev *nvmev_vdev);
+
+static int NVMEV_DISPATCHER_INIT(struct nvmev_dev *nvmev_vdev)
 {
-	nvmev_vdev->nvmev_dispatcher = kthread_create(nvmev_dispatcher, NULL, "nvmev_dispatcher");
-	if (nvmev_vdev->config.cpu_nr_dispatcher != -1)
-		kthread_bind(nvmev_vdev->nvmev_dispatcher, nvmev_vdev->config.cpu_nr_dispatcher);
-	wake_up_process(nvmev_vdev->nvmev_dispatcher);
+	unsigned int i;
+
+	nvmev_vdev->dispatchers = kcalloc(nvmev_vdev->config.nr_dispatchers,
+					  sizeof(struct nvmev_dispatcher), GFP_KERNEL);
+	if (!nvmev_vdev->dispatchers)
+		return -ENOMEM;
+
+	for (i = 0; i < nvmev_vdev->config.nr_dispatchers; i++) {
+		struct nvmev_dispatcher *dispatcher = &nvmev_vdev->dispatchers[i];
+
+		dispatcher->id = i;
+		dispatcher->cpu_nr = nvmev_vdev->config.cpu_nr_dispatchers[i];
+		dispatcher->io_worker_turn = 0;
+
+		/* Keep the name of the first one for the single dispatcher setup */
+		if (i == 0)
+			snprintf(dispatcher->thread_name, sizeof(dispatcher->thread_name),
+				 "nvmev_dispatcher");
+		else
+			snprintf(dispatcher->thread_name, sizeof(dispatcher->thread_name),
+				 "nvmev_dispatcher_%d", i);
+
+		dispatcher->task_struct = kthread_create_on_node(
+			nvmev_dispatcher, dispatcher,
+			dispatcher->cpu_nr != -1 ? cpu_to_node(dispatcher->cpu_nr) : NUMA_NO_NODE,
+			"%s", dispatcher->thread_name);
+		if (IS_ERR(dispatcher->task_struct)) {
+			int ret = PTR_ERR(dispatcher->task_struct);
+
+			NVMEV_ERROR("Cannot create %s\n", dispatcher->thread_name);
+			/* Stops the ones started so far */
+			dispatcher->task_struct = NULL;
+			NVMEV_DISPATCHER_FINAL(nvmev_vdev);
+			return ret;
+		}
+		if (dispatcher->cpu_nr != -1)
+			kthread_bind(dispatcher->task_struct, dispatcher->cpu_nr);
+		wake_up_process(dispatcher->task_struct);
+	}
+
+	return 0;
 }
 
 static void NVMEV_DISPATCHER_FINAL(struct nvmev_dev *nvmev_vdev)
 {
-	if (!IS_ERR_OR_NULL(nvmev_vdev->nvmev_dispatcher)) {
-		kthread_stop(nvmev_vdev->nvmev_dispatcher);
-		nvmev_vdev->nvmev_dispatcher = NULL;
+	unsigned int i;
+
+	if (!nvmev_vdev->dispatchers)
+		return;
+
+	for (i = 0; i < nvmev_vdev->config.nr_dispatchers; i++) {
+		struct nvmev_dispatcher *dispatcher = &nvmev_vdev->dispatchers[i];
+
+		if (!IS_ERR_OR_NULL(dispatcher->task_struct)) {
+			kthread_stop(dispatcher->task_struct);
+			dispatcher->task_struct = NULL;
+		}
+	}
+
+	kfree(nvmev_vdev->dispatchers);
+	nvmev_vdev->dispatchers = NULL;
+}
+
+/*
+ * Wait until every dispatcher is done with the pass it may be in. Passes
+ * started afterwards see whatever the caller stored before, such as the
+ * size of the IO worker pool or a deleted queue. A dispatcher calling this,
+ * as for admin commands, does not wait on its own pass.
+ */
+void nvmev_sync_dispatchers(void)
+{
+	unsigned int i;
+
+	smp_mb(); /* Order the caller's stores before reading @pass_seq */
+
+	for (i = 0; i < nvmev_vdev->config.nr_dispatchers; i++) {
+		struct nvmev_dispatcher *dispatcher = &nvmev_vdev->dispatchers[i];
+		unsigned long seq = READ_ONCE(dispatcher->pass_seq);
+
+		if (dispatcher->task_struct == current)
+			continue;
+
+		while (READ_ONCE(dispatcher->pass_seq) == seq)
+			usleep_range(10, 100);
 	}
 }
 
+/* Serializes resizing the IO worker pool and reading or resetting its statistics */
+static DEFINE_MUTEX(workers_lock);
+
+/*
+ * Grow or shrink the IO worker pool while the device is live. The
+ * dispatchers keep running; see nvmev_add_io_worker() and
+ * nvmev_remove_io_worker() for how the workers are quiesced.
+ */
+static int __resize_io_workers(bool add, unsigned int cpu_nr)
+{
+	int ret;
+
+	mutex_lock(&workers_lock);
+	ret = add ? nvmev_add_io_worker(cpu_nr) : nvmev_remove_io_worker();
+	mutex_unlock(&workers_lock);
+
+	return ret;
+}
+
 #ifdef CONFIG_X86
 static int __validate_configs_arch(void)
 {
@@ -293,15 +578,78 @@ static void __print_perf_configs(void)
 #endif
 }
 
+/* Entries the host queued that are yet to be fetched, read as the dispatchers do */
 static int __get_nr_entries(int dbs_idx, int queue_size)
 {
-	int diff = nvmev_vdev->dbs[dbs_idx] - nvmev_vdev->old_dbs[dbs_idx];
+	u32 *dbbuf_dbs = smp_load_acquire(&nvmev_vdev->dbbuf_dbs);
+	int diff = __read_io_db(dbbuf_dbs, dbs_idx) - nvmev_vdev->old_dbs[dbs_idx];
 	if (diff < 0) {
 		diff += queue_size;
 	}
 	return diff;
 }
 
+/*
+ * Per IO worker statistics over the time since the last reset. A worker is
+ * marked saturated when it was busy almost all the time or a noticeable part
+ * of its completions were late, i.e., the results are bound by the CPU rather
+ * than by the performance model. Reading has no side effects, so concurrent
+ * readers see the same interval.
+ */
+static void __proc_show_workers(struct seq_file *m)
+{
+	struct nvmev_config *cfg = &nvmev_vdev->config;
+	unsigned long long now = nvmev_clock();
+	int i;
+
+	mutex_lock(&workers_lock);
+
+	seq_printf(m, "# id cpu util(%%) copied stolen completed late(%%) mean_late max_late "
+		      "copy_late saturated\n");
+	for (i = 0; nvmev_vdev->io_workers && i < cfg->nr_io_workers; i++) {
+		struct nvmev_io_worker *worker = &nvmev_vdev->io_workers[i];
+		/* Not cleared by the worker yet. Nothing since the reset, then */
+		bool max_reset = smp_load_acquire(&worker->stat_reset_max);
+		struct nvmev_io_worker_stat stat = worker->stat;
+		struct nvmev_io_worker_stat *prev = &worker->stat_prev;
+		unsigned long long elapsed = now - worker->stat_clock_prev;
+		unsigned long long nr_completed = stat.nr_completed - prev->nr_completed;
+		unsigned long long util = 0, late = 0, mean_late = 0;
+
+		if (elapsed)
+			util = min(div64_u64((stat.busy_nsecs - prev->busy_nsecs) * 100, elapsed),
+				   100ULL);
+		if (nr_completed) {
+			late = div64_u64((stat.nr_late - prev->nr_late) * 100, nr_completed);
+			mean_late = div64_u64(stat.late_nsecs - prev->late_nsecs, nr_completed);
+		}
+
+		seq_printf(m, "%2d: %3u %3llu %llu %llu %llu %3llu %llu %llu %llu %s\n", i,
+			   cfg->cpu_nr_io_workers[i], util, stat.nr_copied, stat.nr_stolen,
+			   stat.nr_completed, late, mean_late, max_reset ? 0 : stat.max_late_nsecs,
+			   stat.nr_copy_late, (util >= 90 || late >= 1) ? "yes" : "no");
+	}
+
+	mutex_unlock(&workers_lock);
+}
+
+/* Start a new interval for the worker statistics */
+static void __reset_worker_stats(void)
+{
+	unsigned long long now = nvmev_clock();
+	int i;
+
+	mutex_lock(&workers_lock);
+	for (i = 0; nvmev_vdev->io_workers && i < nvmev_vdev->config.nr_io_workers; i++) {
+		struct nvmev_io_worker *worker = &nvmev_vdev->io_workers[i];
+
+		worker->stat_prev = worker->stat;
+		worker->stat_clock_prev = now;
+		WRITE_ONCE(worker->stat_reset_max, true);
+	}
+	mutex_unlock(&workers_lock);
+}
+
 static int __proc_file_read(struct seq_file *m, void *data)
 {
 	const char *filename = m->private;
@@ -341,6 +689,12 @@ static int __proc_file_read(struct seq_file *m, void *data)
 		}
 		seq_printf(m, "total: %u %u %u %llu\n", nr_in_flight, nr_dispatch, nr_dispatched,
 			   total_io);
+	} else if (strcmp(filename, "workers") == 0) {
+		__proc_show_workers(m);
+	} else if (strcmp(filename, "latency") == 0) {
+		mutex_lock(&workers_lock);
+		nvmev_show_latency(m);
+		mutex_unlock(&workers_lock);
 	} else if (strcmp(filename, "debug") == 0) {
 		/* Left for later use */
 	}
@@ -359,7 +713,8 @@ static ssize_t __proc_file_write(struct file *file, const char __user *buf, size
 	struct nvmev_config *cfg = &nvmev_vdev->config;
 	size_t nr_copied;
 
-	nr_copied = copy_from_user(input, buf, min(len, sizeof(input)));
+	nr_copied = copy_from_user(input, buf, min(len, sizeof(input) - 1));
+	input[min(len, sizeof(input) - 1)] = '\0';
 
 	if (!strcmp(filename, "read_times")) {
 		ret = sscanf(input, "%u %u %u", &cfg->read_delay, &cfg->read_time,
@@ -391,6 +746,25 @@ static ssize_t __proc_file_write(struct file *file, const char __user *buf, size
 
 			memset(&sq->stat, 0x00, sizeof(sq->stat));
 		}
+	} else if (!strcmp(filename, "latency")) {
+		mutex_lock(&workers_lock);
+		nvmev_reset_latency();
+		mutex_unlock(&workers_lock);
+	} else if (!strcmp(filename, "workers")) {
+		unsigned int cpu_nr;
+		int err = -EINVAL;
+
+		if (sscanf(input, "add %u", &cpu_nr) == 1) {
+			err = __resize_io_workers(true, cpu_nr);
+		} else if (!strncmp(input, "remove", 6)) {
+			err = __resize_io_workers(false, 0);
+		} else if (!strncmp(input, "reset", 5)) {
+			__reset_worker_stats();
+			err = 0;
+		}
+
+		if (err)
+			return err;
 	} else if (!strcmp(filename, "debug")) {
 		/* Left for later use */
 	}
@@ -449,6 +823,10 @@ static void NVMEV_STORAGE_INIT(struct nvmev_dev *nvmev_vdev)
 		proc_create("io_units", 0664, nvmev_vdev->proc_root, &proc_file_fops);
 	nvmev_vdev->proc_stat = proc_create("stat", 0444, nvmev_vdev->proc_root, &proc_file_fops);
 	nvmev_vdev->proc_debug = proc_create("debug", 0444, nvmev_vdev->proc_root, &proc_file_fops);
+	nvmev_vdev->proc_workers =
+		proc_create("workers", 0664, nvmev_vdev->proc_root, &proc_file_fops);
+	nvmev_vdev->proc_latency =
+		proc_create("latency", 0664, nvmev_vdev->proc_root, &proc_file_fops);
 }
 
 static void NVMEV_STORAGE_FINAL(struct nvmev_dev *nvmev_vdev)
@@ -458,6 +836,8 @@ static void NVMEV_STORAGE_FINAL(struct nvmev_dev *nvmev_vdev)
 	remove_proc_entry("io_units", nvmev_vdev->proc_root);
 	remove_proc_entry("stat", nvmev_vdev->proc_root);
 	remove_proc_entry("debug", nvmev_vdev->proc_root);
+	remove_proc_entry("workers", nvmev_vdev->proc_root);
+	remove_proc_entry("latency", nvmev_vdev->proc_root);
 
 	remove_proc_entry("nvmev", NULL);
 
@@ -470,7 +850,7 @@ static void NVMEV_STORAGE_FINAL(struct nvmev_dev *nvmev_vdev)
 
 static bool __load_configs(struct nvmev_config *config)
 {
-	bool first = true;
+	unsigned int nr_cpus = 0;
 	unsigned int cpu_nr;
 	char *cpu;
 
@@ -496,24 +876,96 @@ static bool __load_configs(struct nvmev_config *config)
 	config->write_trailing = write_trailing;
 	config->nr_io_units = nr_io_units;
 	config->io_unit_shift = io_unit_shift;
+	config->io_worker_spin_ns = io_worker_spin_ns;
+	config->io_queue_depth = roundup_pow_of_two(clamp_t(unsigned int, io_queue_depth,
+							    NR_MIN_PARALLEL_IO, NR_MAX_PARALLEL_IO_LIMIT));
+	config->nt_copy_threshold = nt_copy_threshold;
+	config->copy_chunk_size = copy_chunk_size;
+	config->io_worker_steal = io_worker_steal;
+	config->ftl_numa_local = ftl_numa_local;
+	config->cq_owner = cq_owner;
+	config->bg_gc_high = min(bg_gc_high, 100U);
+	config->bg_gc_low = min(bg_gc_low, config->bg_gc_high);
 
 	config->nr_io_workers = 0;
-	config->cpu_nr_dispatcher = -1;
+	config->nr_dispatchers = clamp_t(unsigned int, nr_dispatchers, 1,
+					 ARRAY_SIZE(config->cpu_nr_dispatchers));
+	config->cpu_nr_dispatchers[0] = -1;
 
 	while ((cpu = strsep(&cpus, ",")) != NULL) {
 		cpu_nr = (unsigned int)simple_strtol(cpu, NULL, 10);
-		if (first) {
-			config->cpu_nr_dispatcher = cpu_nr;
+		if (nr_cpus < config->nr_dispatchers) {
+			config->cpu_nr_dispatchers[nr_cpus] = cpu_nr;
 		} else {
 			config->cpu_nr_io_workers[config->nr_io_workers] = cpu_nr;
 			config->nr_io_workers++;
 		}
-		first = false;
+		nr_cpus++;
+	}
+
+	if (nr_cpus < config->nr_dispatchers)
+		config->nr_dispatchers = max(nr_cpus, 1U);
+	config->cpu_nr_dispatcher = config->cpu_nr_dispatchers[0];
+
+#ifndef CONFIG_NVMEV_IO_WORKER_BY_SQ
+	if (config->nr_dispatchers > 1) {
+		NVMEV_ERROR("Multiple dispatchers need CONFIG_NVMEV_IO_WORKER_BY_SQ\n");
+		return false;
+	}
+	if (config->cq_owner) {
+		NVMEV_ERROR("cq_owner needs CONFIG_NVMEV_IO_WORKER_BY_SQ\n");
+		return false;
+	}
+#endif
+	if (config->nr_io_workers < config->nr_dispatchers) {
+		NVMEV_ERROR("Need at least one IO worker per dispatcher (%u < %u)\n",
+			    config->nr_io_workers, config->nr_dispatchers);
+		return false;
 	}
 
 	return true;
 }
 
+static int __memmap_node(unsigned long paddr)
+{
+#ifdef CONFIG_NUMA_KEEP_MEMINFO
+	/* The reserved region has no struct page. Look it up in the firmware tables */
+	int nid = phys_to_target_node(paddr);
+
+	if (nid != NUMA_NO_NODE)
+		return nid;
+#endif
+	if (pfn_valid(PHYS_PFN(paddr)))
+		return pfn_to_nid(PHYS_PFN(paddr));
+
+	return NUMA_NO_NODE;
+}
+
+/* Copies across the interconnect cost much of the bandwidth. Let the user know */
+static void __check_numa_placement(struct nvmev_config *config)
+{
+	int nid = __memmap_node(config->memmap_start);
+	unsigned int i;
+
+	if (nid == NUMA_NO_NODE || num_online_nodes() == 1)
+		return;
+
+	for (i = 0; i < config->nr_dispatchers; i++) {
+		if (config->cpu_nr_dispatchers[i] != -1 &&
+		    cpu_to_node(config->cpu_nr_dispatchers[i]) != nid)
+			NVMEV_ERROR("Dispatcher cpu %u is on node %d, but memmap is on node %d\n",
+				    config->cpu_nr_dispatchers[i],
+				    cpu_to_node(config->cpu_nr_dispatchers[i]), nid);
+	}
+
+	for (i = 0; i < config->nr_io_workers; i++) {
+		if (cpu_to_node(config->cpu_nr_io_workers[i]) != nid)
+			NVMEV_ERROR("IO worker cpu %u is on node %d, but memmap is on node %d\n",
+				    config->cpu_nr_io_workers[i],
+				    cpu_to_node(config->cpu_nr_io_workers[i]), nid);
+	}
+}
+
 static void NVMEV_NAMESPACE_INIT(struct nvmev_dev *nvmev_vdev)
 {
 	unsigned long long remaining_capacity = nvmev_vdev->config.storage_size;
@@ -523,7 +975,7 @@ static void NVMEV_NAMESPACE_INIT(struct nvmev_dev *nvmev_vdev)
 	int i;
 	unsigned long long size;
 
-	struct nvmev_ns *ns = kmalloc(sizeof(struct nvmev_ns) * nr_ns, GFP_KERNEL);
+	struct nvmev_ns *ns = kcalloc(nr_ns, sizeof(struct nvmev_ns), GFP_KERNEL);
 
 	for (i = 0; i < nr_ns; i++) {
 		if (NS_CAPACITY(i) == 0)
@@ -542,6 +994,11 @@ static void NVMEV_NAMESPACE_INIT(struct nvmev_dev *nvmev_vdev)
 		else
 			BUG_ON(1);
 
+		/* conv FTL locks each partition by itself */
+		ns[i].lock_io_cmd = nvmev_vdev->config.nr_dispatchers > 1 &&
+				    NS_SSD_TYPE(i) != SSD_TYPE_CONV;
+		spin_lock_init(&ns[i].io_cmd_lock);
+
 		remaining_capacity -= size;
 		ns_addr += size;
 		NVMEV_INFO("ns %d/%d: size %lld MiB\n", i, nr_ns, BYTE_TO_MB(ns[i].size));
@@ -606,6 +1063,8 @@ static int NVMeV_init(void)
 
 	__print_base_config();
 
+	nvmev_clock_init();
+
 	nvmev_vdev = VDEV_INIT();
 	if (!nvmev_vdev)
 		return -EINVAL;
@@ -614,14 +1073,23 @@ static int NVMeV_init(void)
 		goto ret_err;
 	}
 
+	__check_numa_placement(&nvmev_vdev->config);
+
 	NVMEV_STORAGE_INIT(nvmev_vdev);
 
 	NVMEV_NAMESPACE_INIT(nvmev_vdev);
 
-	if (io_using_dma) {
-		if (ioat_dma_chan_set("dma7chan0") != 0) {
-			io_using_dma = false;
-			NVMEV_ERROR("Cannot use DMA engine, Fall back to memcpy\n");
+	if (dma_chans) {
+		char *chan;
+
+		io_using_dma = true;
+		while ((chan = strsep(&dma_chans, ",")) != NULL) {
+			if (ioat_dma_chan_set(strcmp(chan, "any") ? chan : "") != 0) {
+				ioat_dma_cleanup();
+				io_using_dma = false;
+				NVMEV_ERROR("Cannot use DMA engine, Fall back to memcpy\n");
+				break;
+			}
 		}
 	}
 
@@ -631,8 +1099,13 @@ static int NVMeV_init(void)
 
 	__print_perf_configs();
 
-	NVMEV_IO_WORKER_INIT(nvmev_vdev);
-	NVMEV_DISPATCHER_INIT(nvmev_vdev);
+	ret = NVMEV_IO_WORKER_INIT(nvmev_vdev);
+	if (ret)
+		goto ret_err_io_worker;
+
+	ret = NVMEV_DISPATCHER_INIT(nvmev_vdev);
+	if (ret)
+		goto ret_err_dispatcher;
 
 	pci_bus_add_devices(nvmev_vdev->virt_bus);
 
@@ -640,6 +1113,20 @@ static int NVMeV_init(void)
 
 	return 0;
 
+ret_err_dispatcher:
+	NVMEV_IO_WORKER_FINAL(nvmev_vdev);
+ret_err_io_worker:
+	pci_remove_root_bus(nvmev_vdev->virt_bus);
+
+	NVMEV_NAMESPACE_FINAL(nvmev_vdev);
+	NVMEV_STORAGE_FINAL(nvmev_vdev);
+
+	if (io_using_dma)
+		ioat_dma_cleanup();
+
+	VDEV_FINALIZE(nvmev_vdev);
+	return ret;
+
 ret_err:
 	VDEV_FINALIZE(nvmev_vdev);
 	return -EIO;
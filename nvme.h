@@ -32,6 +32,18 @@ struct nvme_bar {
 #define NVME_CAP_MPSMIN(cap) (((cap) >> 48) & 0xf)
 #define NVME_CAP_MPSMAX(cap) (((cap) >> 52) & 0xf)
 
+/* Arbitration mechanisms of CAP.AMS and CC.AMS */
+#define NVME_CAP_AMS_WRRU 0x1
+#define NVME_CC_AMS_RR 0x0
+#define NVME_CC_AMS_WRRU 0x1
+
+/* Dword 11 of NVME_FEAT_ARBITRATION */
+#define NVME_ARB_AB(arb) ((arb)&0x7)
+#define NVME_ARB_AB_NOLIMIT 0x7
+#define NVME_ARB_LPW(arb) (((arb) >> 8) & 0xff)
+#define NVME_ARB_MPW(arb) (((arb) >> 16) & 0xff)
+#define NVME_ARB_HPW(arb) (((arb) >> 24) & 0xff)
+
 #define NVME_CMB_BIR(cmbloc) ((cmbloc)&0x7)
 #define NVME_CMB_OFST(cmbloc) (((cmbloc) >> 12) & 0xfffff)
 #define NVME_CMB_SZ(cmbsz) (((cmbsz) >> 12) & 0xfffff)
@@ -144,6 +156,9 @@ enum {
 	NVME_CTRL_ONCS_WRITE_UNCORRECTABLE = 1 << 1,
 	NVME_CTRL_ONCS_DSM = 1 << 2,
 	NVME_CTRL_VWC_PRESENT = 1 << 0,
+	NVME_CTRL_SGLS_SUPPORTED = 1 << 0,
+	NVME_CTRL_SGLS_BIT_BUCKET = 1 << 16,
+	NVME_CTRL_OACS_DBBUF_SUPP = 1 << 8,
 };
 
 struct nvme_lbaf {
@@ -355,6 +370,28 @@ struct nvme_common_command {
 	__le32 cdw10[6];
 };
 
+/* PSDT field of the command flags: PRP or SGL for the data pointer */
+enum {
+	NVME_CMD_SGL_METABUF = (1 << 6),
+	NVME_CMD_SGL_METASEG = (1 << 7),
+	NVME_CMD_SGL_ALL = NVME_CMD_SGL_METABUF | NVME_CMD_SGL_METASEG,
+};
+
+/* SGL descriptor types, in the upper 4 bits of the type field */
+enum {
+	NVME_SGL_FMT_DATA_DESC = 0x00,
+	NVME_SGL_FMT_BIT_BUCKET_DESC = 0x01,
+	NVME_SGL_FMT_SEG_DESC = 0x02,
+	NVME_SGL_FMT_LAST_SEG_DESC = 0x03,
+};
+
+struct nvme_sgl_desc {
+	__le64 addr;
+	__le32 length;
+	__u8 rsvd[3];
+	__u8 type;
+};
+
 struct nvme_rw_command {
 	__u8 opcode;
 	__u8 flags;
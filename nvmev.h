@@ -8,6 +8,7 @@
 #include <asm/apic.h>
 
 #include "nvme.h"
+#include "clock.h"
 
 #define CONFIG_NVMEV_IO_WORKER_BY_SQ
 #undef CONFIG_NVMEV_FAST_X86_IRQ_HANDLING
@@ -55,7 +56,19 @@
 
 
 #define NR_MAX_IO_QUEUE 72
-#define NR_MAX_PARALLEL_IO 16384
+#define NR_MAX_PARALLEL_IO 16384 /* default io_queue_depth */
+#define NR_MIN_PARALLEL_IO 256
+#define NR_MAX_PARALLEL_IO_LIMIT (1 << 20)
+#define NR_MAX_COPY_CHUNKS 4096
+/*
+ * Work entries of an IO worker kept for internal operations. A command
+ * schedules at most one per flash page it writes, and host commands leave
+ * this many free before they are taken in.
+ */
+#define NR_INTERNAL_IO_RESERVED ((1 << MDTS) + 1)
+
+/* Arbitration burst of 2^3 commands per SQ per turn unless the host sets one */
+#define NVMEV_DEFAULT_ARB_BURST 3
 
 #define NVMEV_INTX_IRQ 15
 
@@ -94,7 +107,7 @@ struct nvmev_sq_stat {
 struct nvmev_submission_queue {
 	int qid;
 	int cqid;
-	int priority;
+	int priority; /* NVME_SQ_PRIO_* */
 	bool phys_contig;
 
 	int queue_size;
@@ -115,6 +128,13 @@ struct nvmev_completion_queue {
 	spinlock_t entry_lock;
 	struct mutex irq_lock;
 
+	/* Completions posted since the last interrupt, for interrupt coalescing */
+	unsigned int nr_irq_pending;
+	unsigned long long nsecs_irq_pending; /* when the first of them was posted */
+
+	/* CQ owner mode: entries written by the owner worker but not posted yet */
+	unsigned int nr_staged;
+
 	int queue_size;
 
 	int phase;
@@ -153,9 +173,20 @@ struct nvmev_config {
 	unsigned long storage_start; //byte
 	unsigned long storage_size; // byte
 
-	unsigned int cpu_nr_dispatcher;
+	unsigned int cpu_nr_dispatcher; /* cpu of the first dispatcher */
+	unsigned int nr_dispatchers;
+	unsigned int cpu_nr_dispatchers[32];
 	unsigned int nr_io_workers;
 	unsigned int cpu_nr_io_workers[32];
+	unsigned int io_worker_spin_ns; /* sleep if nothing is due within this, 0 to always spin */
+	unsigned int io_queue_depth; /* work_queue entries per IO worker, a power of 2 */
+	unsigned int nt_copy_threshold; /* bypass the cache for writes of this size or larger, 0 to disable */
+	unsigned int copy_chunk_size; /* split larger copies among the IO workers, 0 to disable */
+	bool io_worker_steal; /* let idle IO workers copy io reqs of loaded ones */
+	bool ftl_numa_local; /* FTL metadata on the node of the dispatchers */
+	bool cq_owner; /* shard by CQ so that each CQ is posted by one IO worker */
+	unsigned int bg_gc_low; /* % of free lines idle-time GC reclaims only cheap lines above */
+	unsigned int bg_gc_high; /* % of free lines idle-time GC keeps, 0 to disable */
 
 	/* TODO Refactoring storage configurations */
 	unsigned int nr_io_units;
@@ -169,12 +200,21 @@ struct nvmev_config {
 	unsigned int write_trailing; // ns
 };
 
+/* Who copies the data of an io req */
+enum {
+	IO_COPY_PENDING = 0,
+	IO_COPY_OWNER, /* the worker the io req was dispatched to */
+	IO_COPY_STOLEN, /* another worker, in progress */
+	IO_COPY_STOLEN_DONE,
+};
+
 struct nvmev_io_work {
 	int sqid;
 	int cqid;
 
 	int sq_entry;
 	unsigned int command_id;
+	u8 opcode;
 
 	unsigned long long nsecs_start;
 	unsigned long long nsecs_target;
@@ -182,10 +222,14 @@ struct nvmev_io_work {
 	unsigned long long nsecs_enqueue;
 	unsigned long long nsecs_copy_start;
 	unsigned long long nsecs_copy_done;
+	atomic64_t nsecs_copy_end; /* when the last part of a chunked copy finished */
 	unsigned long long nsecs_cq_filled;
 
 	bool is_copied;
+	bool is_copy_late; /* the data was not in place by nsecs_target */
 	bool is_completed;
+	atomic_t nr_copy_chunks; /* chunks left to other workers */
+	atomic_t copy_state; /* IO_COPY_* */
 
 	unsigned int status;
 	unsigned int result0;
@@ -195,24 +239,139 @@ struct nvmev_io_work {
 	void *write_buffer;
 	size_t buffs_to_release;
 
-	unsigned int next, prev;
+	unsigned int next;
+};
+
+/*
+ * Single-producer/single-consumer ring of work_queue indexes. The producer
+ * only writes @tail and the consumer only writes @head, so they are kept on
+ * separate cache lines.
+ */
+struct nvmev_io_ring {
+	unsigned int *entries;
+	unsigned int mask; /* io_queue_depth - 1 */
+	unsigned int head ____cacheline_aligned_in_smp;
+	unsigned int tail ____cacheline_aligned_in_smp;
+};
+
+/* Latency histogram, see __lat_bucket() */
+#define LAT_SUB_BITS 3
+#define LAT_NR_SUB (1 << LAT_SUB_BITS)
+#define NR_LAT_BUCKETS (40 * LAT_NR_SUB) /* up to 2^40 ns */
+
+struct nvmev_lat_hist {
+	unsigned long long buckets[NR_LAT_BUCKETS];
+	unsigned long long count;
+	unsigned long long sum;
+	unsigned long long max;
+};
+
+enum {
+	LAT_OP_READ,
+	LAT_OP_WRITE,
+	LAT_OP_OTHER,
+	NR_LAT_OPS,
+};
+
+enum {
+	LAT_TARGET, /* emulated latency, nsecs_target - nsecs_start */
+	LAT_COPY, /* time to copy the data */
+	LAT_LATENESS, /* completion past nsecs_target */
+	NR_LAT_METRICS,
+};
+
+struct nvmev_sq_lat {
+	struct nvmev_lat_hist hist[NR_LAT_OPS][NR_LAT_METRICS];
 };
 
+/* Part of a large copy that any IO worker can take over */
+struct nvmev_copy_chunk {
+	unsigned int worker_id; /* owner of the command */
+	unsigned int entry;
+	u64 paddr; /* physically contiguous host memory */
+	unsigned int xfer_offs;
+	unsigned int len;
+};
+
+struct nvmev_copy_chunk_queue {
+	spinlock_t lock;
+	struct nvmev_copy_chunk *chunks;
+	unsigned int head;
+	unsigned int tail;
+};
+
+/*
+ * A completion posted more than this past its target time is counted as
+ * late. Many late completions mean the IO worker cannot keep up, and the
+ * emulated device looks slower than its model.
+ */
+#define IO_WORKER_LATE_NSECS 5000
+
+struct nvmev_io_worker_stat {
+	unsigned long long busy_nsecs; /* time spent on io reqs */
+	unsigned long long nr_copied;
+	unsigned long long nr_stolen; /* copies taken over from peers */
+	unsigned long long nr_completed;
+	unsigned long long nr_late; /* completions later than IO_WORKER_LATE_NSECS */
+	unsigned long long late_nsecs; /* sum of how late completions were */
+	unsigned long long max_late_nsecs; /* since the last reset */
+	unsigned long long nr_copy_late; /* copies done after the target time */
+};
+
+struct ioat_dma_batch;
+
 struct nvmev_io_worker {
 	struct nvmev_io_work *work_queue;
 
-	unsigned int free_seq; /* free io req head index */
-	unsigned int free_seq_end; /* free io req tail index */
-	unsigned int io_seq; /* io req head index */
-	unsigned int io_seq_end; /* io req tail index */
+	unsigned int free_seq; /* free io req head index, owned by the dispatcher */
+	unsigned int nr_allocated; /* io reqs taken off the free list, owned by the dispatcher */
+	unsigned int ret_seq ____cacheline_aligned_in_smp; /* reclaimed io reqs returned by the worker */
+	unsigned int nr_returned; /* io reqs returned so far, owned by the worker */
+
+	struct nvmev_io_ring submit_ring; /* dispatcher -> worker */
+
+	/* Completed io reqs not yet returned to the dispatcher. Owned by the worker */
+	unsigned int reclaim_seq;
+	unsigned int reclaim_seq_end;
+	unsigned int nr_reclaimed;
+
+	/* Dispatched io reqs, min-heap ordered by nsecs_target. Owned by the worker */
+	unsigned int *target_heap;
+	unsigned int nr_targets;
+
+	/* DMA copies of the io reqs, indexed like work_queue. Owned by the worker */
+	struct ioat_dma_batch *dma_batches;
+
+	/* CQs with staged entries in CQ owner mode. Owned by the worker */
+	DECLARE_BITMAP(cq_staged, NR_MAX_IO_QUEUE + 1);
 
 	unsigned long long latest_nsecs;
+	bool sleeping;
+
+	/* Updated by the worker only, sampled through /proc/nvmev/workers */
+	struct nvmev_io_worker_stat stat;
+	struct nvmev_io_worker_stat stat_prev; /* at the last reset */
+	unsigned long long stat_clock_prev;
+	bool stat_reset_max; /* max_late_nsecs to be cleared by the worker */
+
+	/* Latency histograms of the completions posted by the worker, indexed by sqid */
+	struct nvmev_sq_lat *sq_lat;
+	bool lat_reset; /* sq_lat to be cleared by the worker */
 
 	unsigned int id;
 	struct task_struct *task_struct;
 	char thread_name[32];
 };
 
+struct nvmev_dispatcher {
+	unsigned int id;
+	unsigned int cpu_nr;
+	unsigned int io_worker_turn;
+	unsigned long pass_seq; /* bumped after every pass, see nvmev_sync_dispatchers() */
+	struct task_struct *task_struct;
+	char thread_name[32];
+};
+
 struct nvmev_dev {
 	struct pci_bus *virt_bus;
 	void *virtDev;
@@ -225,12 +384,13 @@ struct nvmev_dev {
 	struct pci_dev *pdev;
 
 	struct nvmev_config config;
-	struct task_struct *nvmev_dispatcher;
+	struct nvmev_dispatcher *dispatchers;
+	bool io_dispatch_paused; /* dispatchers leave the IO SQs alone */
 
 	void *storage_mapped;
 
 	struct nvmev_io_worker *io_workers;
-	unsigned int io_worker_turn;
+	struct nvmev_copy_chunk_queue copy_chunks; /* shared by the IO workers */
 
 	void __iomem *msix_table;
 
@@ -242,6 +402,11 @@ struct nvmev_dev {
 	u32 *old_dbs;
 	u32 __iomem *dbs;
 
+	/* Doorbell Buffer Config. Shadow doorbells and EventIdx of the I/O queues */
+	u32 *dbbuf_dbs;
+	u32 *dbbuf_eis;
+	unsigned int dbbuf_shift; /* CAP.DSTRD as set up by the PCI code, see nvmev_dbbuf_idx() */
+
 	struct nvmev_ns *ns;
 	unsigned int nr_ns;
 	unsigned int nr_sq;
@@ -253,12 +418,23 @@ struct nvmev_dev {
 
 	unsigned int mdts;
 
+	/* Interrupt coalescing. See NVME_FEAT_IRQ_COALESCE and NVME_FEAT_IRQ_CONFIG */
+	unsigned int irq_aggr_thr; /* 0-based */
+	unsigned int irq_aggr_time; /* 100 us */
+	DECLARE_BITMAP(irq_coalesce_disabled, NR_MAX_IO_QUEUE + 1);
+
+	/* SQ arbitration, in the NVME_FEAT_ARBITRATION layout */
+	u32 arbitration;
+	unsigned int ams; /* CC.AMS, latched when the controller is enabled */
+
 	struct proc_dir_entry *proc_root;
 	struct proc_dir_entry *proc_read_times;
 	struct proc_dir_entry *proc_write_times;
 	struct proc_dir_entry *proc_io_units;
 	struct proc_dir_entry *proc_stat;
 	struct proc_dir_entry *proc_debug;
+	struct proc_dir_entry *proc_workers;
+	struct proc_dir_entry *proc_latency;
 
 	unsigned long long *io_unit_stat;
 };
@@ -284,6 +460,10 @@ struct nvmev_ns {
 	uint32_t nr_parts; // 해당 네임스페이스가 가지는 partition 수
 	void *ftls; // ftl instances. one ftl per partition
 
+	/* Serializes proc_io_cmd of multiple dispatchers if the FTL does not lock by itself */
+	bool lock_io_cmd;
+	spinlock_t io_cmd_lock;
+
 	/*io command handler*/  // nvmev_request로 I/O request 들어왔을 때 가장 먼저 실행됨
 	bool (*proc_io_cmd)(struct nvmev_ns *ns, struct nvmev_request *req,
 			    struct nvmev_result *ret);
@@ -293,10 +473,22 @@ struct nvmev_ns {
 	/*specific CSS io command processor*/  // 실제로 I/O 수행하는 핵심 함수 (주소변환 & 지연시간 계산 & Status 반환)
 	unsigned int (*perform_io_cmd)(struct nvmev_ns *ns, struct nvme_command *cmd,
 				       uint32_t *status);
+
+	/*background work while a dispatcher has no doorbell to serve, optional*/
+	void (*proc_idle)(struct nvmev_ns *ns, unsigned int dispatcher_id);
 };
 
 // VDEV Init, Final Function
 extern struct nvmev_dev *nvmev_vdev;
+
+/*
+ * The doorbell buffers are laid out like the doorbell registers, which are
+ * (4 << CAP.DSTRD) bytes apart. @dbs_idx is qid * 2, plus 1 for a CQ.
+ */
+static inline unsigned int nvmev_dbbuf_idx(int dbs_idx)
+{
+	return dbs_idx << nvmev_vdev->dbbuf_shift;
+}
 struct nvmev_dev *VDEV_INIT(void);
 void VDEV_FINALIZE(struct nvmev_dev *nvmev_vdev);
 
@@ -313,9 +505,21 @@ void nvmev_proc_admin_cq(int new_db, int old_db);
 struct buffer;
 void schedule_internal_operation(int sqid, unsigned long long nsecs_target,
 				struct buffer *write_buffer, size_t buffs_to_release);
-void NVMEV_IO_WORKER_INIT(struct nvmev_dev *nvmev_vdev);
+typedef void (*nvmev_data_seg_fn)(u64 paddr, size_t len, size_t xfer_offs, void *arg);
+unsigned int nvmev_walk_data_ptr(u8 flags, u64 dptr1, u64 dptr2, size_t length,
+				 nvmev_data_seg_fn fn, void *arg);
+unsigned int nvmev_copy_data_ptr(u8 flags, u64 dptr1, u64 dptr2, void *buf, size_t length,
+				 bool to_host);
+struct seq_file;
+void nvmev_show_latency(struct seq_file *m);
+void nvmev_reset_latency(void);
+void nvmev_sync_dispatchers(void);
+int nvmev_add_io_worker(unsigned int cpu_nr);
+int nvmev_remove_io_worker(void);
+int NVMEV_IO_WORKER_INIT(struct nvmev_dev *nvmev_vdev);
 void NVMEV_IO_WORKER_FINAL(struct nvmev_dev *nvmev_vdev);
-int nvmev_proc_io_sq(int qid, int new_db, int old_db);
-void nvmev_proc_io_cq(int qid, int new_db, int old_db);
+int nvmev_proc_io_sq(struct nvmev_submission_queue *sq, int new_db, int old_db,
+		     unsigned int max_proc);
+void nvmev_proc_io_cq(struct nvmev_completion_queue *cq, int new_db, int old_db);
 
 #endif /* _LIB_NVMEV_H */
@@ -234,12 +234,17 @@ bool nvmev_proc_bars(void)
 		/* Enable */
 		if (bar->cc.en == 1) {
 			if (nvmev_vdev->admin_q) {
+				WRITE_ONCE(nvmev_vdev->ams, bar->cc.ams);
 				bar->csts.rdy = 1;
 			} else {
 				WARN_ON("Enable device without init admin q");
 			}
 		} else if (bar->cc.en == 0) {
 			bar->csts.rdy = 0;
+
+			/* Doorbell Buffer Config does not survive a controller reset */
+			WRITE_ONCE(nvmev_vdev->dbbuf_dbs, NULL);
+			WRITE_ONCE(nvmev_vdev->dbbuf_eis, NULL);
 		}
 
 		/* Shutdown */
@@ -375,6 +380,7 @@ static void __init_nvme_ctrl_regs(struct pci_dev *dev)
 			.to = 1,
 			.mpsmin = 0,
 			.mqes = 1024 - 1, // 0-based value
+			.ams = NVME_CAP_AMS_WRRU,
 #if (SUPPORTED_SSD_TYPE(ZNS))
 			.css = CAP_CSS_BIT_SPECIFIC,
 #endif
@@ -384,6 +390,8 @@ static void __init_nvme_ctrl_regs(struct pci_dev *dev)
 			.mnr = 0,
 		},
 	};
+
+	nvmev_vdev->dbbuf_shift = bar->cap.dstrd;
 }
 
 static struct pci_bus *__create_pci_bus(void)
@@ -444,6 +452,7 @@ struct nvmev_dev *VDEV_INIT(void)
 	nvmev_vdev->extcap = nvmev_vdev->virtDev + OFFS_PCI_EXT_CAP;
 
 	nvmev_vdev->admin_q = NULL;
+	nvmev_vdev->arbitration = NVMEV_DEFAULT_ARB_BURST;
 
 	return nvmev_vdev;
 }
@@ -7,7 +7,6 @@
 #include <linux/prandom.h>
 #include "../nvmev.h"
 #include "pqueue.h"
-#include "../conv_ftl.h"
 
 #define left(i) ((i) << 1)
 #define right(i) (((i) << 1) + 1)
@@ -192,56 +191,6 @@ void *pqueue_peek(pqueue_t *q)
 	return d;
 }
 
-void *cost_benefit_select(pqueue_t *q){
-	struct line *min_line;
-	uint64_t min_res, now;
-	size_t i;
-
-	printk("Queue Size: %zu\n", pqueue_size(q));
-
-	if (!q || q->size == 1)
-		return NULL;
-
-	min_line = NULL;
-	min_res = 0xFFFFFFFFFFFFFFFF;
-	now = ktime_get_ns();
-	 
-	for (i=1; i<q->size; i++){
-		struct line *curr = (struct line *)q->d[i];
-		uint64_t age, age_lvl, res;
-		age = now - curr->age;
-		do_div(age, 1000000000);
-
-		// fio 실행시간 고려
-		if (age <= 10) age_lvl = 1;
-		else if (age <= 20) age_lvl = 2;
-		else if (age <= 45) age_lvl = 3;
-		else if (age <= 90) age_lvl = 4;
-		else if (age <= 180) age_lvl = 5;
-		else if (age <= 360) age_lvl = 6;
-		else age_lvl = 7;
-
-		res = (uint64_t)(curr->vpc);
-		res <<= 10;
-		do_div(res, (uint32_t)(curr->ipc) * age_lvl);
-		
-		
-		if (res < min_res){
-			min_res = res;
-			min_line = curr;
-		}	
-	}
-	if (min_line == NULL) {
-    // 이게 찍힌다면 계산식 문제로 아무것도 못 고른 겁니다.
-    printk("CB_DEBUG: Loop finished but min_line is NULL! min_res was %llu\n", min_res);
-  } else {
-    // 이게 찍힌다면 삭제(remove) 로직 문제입니다.
-    printk("CB_DEBUG: Selected VPC %u, IPC %u, pos %zu\n", min_line->vpc, min_line->ipc, (size_t)min_line->pos);
-  }
-
-	return (void*)min_line;
-}
-
 void *random_select(pqueue_t *q){
 	void *d;
 	unsigned int rand;
@@ -7,7 +7,7 @@
 
 static inline unsigned long long __get_wallclock(void)
 {
-	return cpu_clock(nvmev_vdev->config.cpu_nr_dispatcher);
+	return nvmev_clock();
 }
 
 static size_t __cmd_io_size(struct nvme_rw_command *cmd)
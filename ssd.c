@@ -8,7 +8,7 @@
 
 static inline uint64_t __get_ioclock(struct ssd *ssd)
 {
-	return cpu_clock(ssd->cpu_nr_dispatcher);
+	return nvmev_clock();
 }
 
 void buffer_init(struct buffer *buf, size_t size)
@@ -106,6 +106,10 @@ void ssd_init_params(struct ssdparams *spp, uint64_t capacity, uint32_t nparts)
 
 	spp->pgs_per_blk = spp->pgs_per_oneshotpg * spp->oneshotpgs_per_blk;
 
+	/* no SLC region */
+	spp->blks_per_pl_slc = 0;
+	spp->blks_per_pl_tlc = spp->blks_per_pl;
+
 	spp->write_unit_size = WRITE_UNIT_SIZE;
 
 	spp->pg_4kb_rd_lat[CELL_TYPE_LSB] = NAND_4KB_READ_LATENCY_LSB;
@@ -156,6 +160,8 @@ void ssd_init_params(struct ssdparams *spp, uint64_t capacity, uint32_t nparts)
 	spp->pgs_per_line = spp->blks_per_line * spp->pgs_per_blk;
 	spp->secs_per_line = spp->pgs_per_line * spp->secs_per_pg;
 	spp->tt_lines = spp->blks_per_lun;
+	spp->tt_lines_slc = 0;
+	spp->tt_lines_tlc = spp->tt_lines;
 	/* TODO: to fix under multiplanes */ // lun size is super-block(line) size
 
 	check_params(spp);
@@ -440,6 +446,7 @@ static void ssd_init_pcie(struct ssd_pcie *pcie, struct ssdparams *spp)
 {
 	pcie->perf_model = kmalloc(sizeof(struct channel_model), GFP_KERNEL);
 	chmodel_init(pcie->perf_model, spp->pcie_bandwidth);
+	spin_lock_init(&pcie->lock);
 }
 
 static void ssd_remove_pcie(struct ssd_pcie *pcie)
@@ -491,7 +498,13 @@ void ssd_remove(struct ssd *ssd)
 uint64_t ssd_advance_pcie(struct ssd *ssd, uint64_t request_time, uint64_t length)
 {
 	struct channel_model *perf_model = ssd->pcie->perf_model;
-	return chmodel_request(perf_model, request_time, length);
+	uint64_t nsecs_latest;
+
+	spin_lock(&ssd->pcie->lock);
+	nsecs_latest = chmodel_request(perf_model, request_time, length);
+	spin_unlock(&ssd->pcie->lock);
+
+	return nsecs_latest;
 }
 
 /* Write buffer Performance Model
@@ -526,6 +539,7 @@ uint64_t ssd_advance_nand(struct ssd *ssd, struct nand_cmd *ncmd)
 	struct ssd_channel *ch;
 	struct ppa *ppa = ncmd->ppa;
 	uint32_t cell;
+	bool slc;
 	NVMEV_DEBUG(
 		"SSD: %p, Enter stime: %lld, ch %d lun %d blk %d page %d command %d ppa 0x%llx\n",
 		ssd, ncmd->stime, ppa->g.ch, ppa->g.lun, ppa->g.blk, ppa->g.pg, c, ppa->ppa);
@@ -539,6 +553,7 @@ uint64_t ssd_advance_nand(struct ssd *ssd, struct nand_cmd *ncmd)
 	lun = get_lun(ssd, ppa);
 	ch = get_ch(ssd, ppa);
 	cell = get_cell(ssd, ppa);
+	slc = is_slc_blk(ssd, ppa);
 	remaining = ncmd->xfer_size;
 
 	switch (c) {
@@ -546,7 +561,10 @@ uint64_t ssd_advance_nand(struct ssd *ssd, struct nand_cmd *ncmd)
 		/* read: perform NAND cmd first */
 		nand_stime = max(lun->next_lun_avail_time, cmd_stime);
 
-		if (ncmd->xfer_size == 4096) {
+		if (slc) {
+			nand_etime = nand_stime + (ncmd->xfer_size == 4096 ? spp->pg_4kb_rd_lat_slc :
+									   spp->pg_rd_lat_slc);
+		} else if (ncmd->xfer_size == 4096) {
 			nand_etime = nand_stime + spp->pg_4kb_rd_lat[cell];
 		} else {
 			nand_etime = nand_stime + spp->pg_rd_lat[cell];
@@ -580,7 +598,7 @@ uint64_t ssd_advance_nand(struct ssd *ssd, struct nand_cmd *ncmd)
 
 		/* write: then do NAND program */
 		nand_stime = chnl_etime;
-		nand_etime = nand_stime + spp->pg_wr_lat;
+		nand_etime = nand_stime + (slc ? spp->pg_wr_lat_slc : spp->pg_wr_lat);
 		lun->next_lun_avail_time = nand_etime;
 		completed_time = nand_etime;
 		break;
@@ -588,7 +606,7 @@ uint64_t ssd_advance_nand(struct ssd *ssd, struct nand_cmd *ncmd)
 	case NAND_ERASE:
 		/* erase: only need to advance NAND status */
 		nand_stime = max(lun->next_lun_avail_time, cmd_stime);
-		nand_etime = nand_stime + spp->blk_er_lat;
+		nand_etime = nand_stime + (slc ? spp->blk_er_lat_slc : spp->blk_er_lat);
 		lun->next_lun_avail_time = nand_etime;
 		completed_time = nand_etime;
 		break;
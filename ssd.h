@@ -126,6 +126,7 @@ struct ssd_channel {
 
 struct ssd_pcie {
 	struct channel_model *perf_model;
+	spinlock_t lock; /* shared by all partitions */
 };
 
 struct nand_cmd {
@@ -277,6 +278,12 @@ static inline uint32_t get_cell(struct ssd *ssd, struct ppa *ppa)
 	return (ppa->g.pg / spp->pgs_per_flashpg) % (spp->cell_mode);
 }
 
+/* The first blks_per_pl_slc blocks of each plane are programmed in SLC mode */
+static inline bool is_slc_blk(struct ssd *ssd, struct ppa *ppa)
+{
+	return ppa->g.blk < ssd->sp.blks_per_pl_slc;
+}
+
 void ssd_init_params(struct ssdparams *spp, uint64_t capacity, uint32_t nparts);
 void ssd_init_params_slc(struct ssdparams *spp, uint64_t capacity, uint32_t nparts);
 void ssd_init(struct ssd *ssd, struct ssdparams *spp, uint32_t cpu_nr_dispatcher);